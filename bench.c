@@ -0,0 +1,341 @@
+/*** bench ***/
+
+/* headless benchmark driver: replays scripted keystroke traces against */
+/* synthetic files through a fake terminal and reports per-key latency, */
+/* bytes emitted per frame and peak RSS as JSON on stdout. */
+
+/* usage: ./kilo-bench [--sizes 1K,1M,64M] [--rows 24] [--cols 80] */
+
+#define KILO_NO_MAIN
+#include "kilo.c"
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define BENCH_DEFAULT_SIZES "1K,1M,64M"
+
+/*** fake terminal ***/
+
+typedef struct {
+    char *b; // keystroke bytes
+    int len;
+    int *starts; // byte offset where each key begins
+    int numKeys;
+} trace;
+
+struct {
+    int rows, cols;
+    trace *tr; // trace being replayed
+    int pos; // next byte of tr->b to deliver
+    int key; // next key to start
+    int paused; // an idle gap was reported since the last key finished
+    long written; // bytes written to the terminal so far
+    struct timespec *keyTime; // when each key started being read
+    long *keyBytes; // bytes written before each key started
+} B;
+
+/* read one byte of the current key; between keys report a timeout once, */
+/* so escape sequence parsing never runs into the next key */
+ssize_t benchRead(int fd, void *buf, size_t len) {
+    (void)fd;
+    (void)len;
+    trace *tr = B.tr;
+    int atBoundary = (B.pos >= tr->len) ||
+                     (B.key < tr->numKeys && B.pos == tr->starts[B.key]);
+    if (atBoundary) {
+        if (B.pos > 0 && !B.paused) {
+            B.paused = 1;
+            return 0;
+        }
+        if (B.pos >= tr->len) {
+            errno = EIO; // the script ran out in the middle of a prompt
+            return -1;
+        }
+        B.paused = 0;
+        clock_gettime(CLOCK_MONOTONIC, &B.keyTime[B.key]);
+        B.keyBytes[B.key] = B.written;
+        B.key++;
+    }
+    *(char *)buf = tr->b[B.pos++];
+    return 1;
+}
+
+ssize_t benchWrite(int fd, const void *buf, size_t len) {
+    (void)fd;
+    (void)buf;
+    B.written += len;
+    return len;
+}
+
+int benchWindowSize(int *rows, int *cols) {
+    *rows = B.rows;
+    *cols = B.cols;
+    return 0;
+}
+
+/*** traces ***/
+
+void traceKey(trace *tr, const char *s, int len) {
+    tr->starts = realloc(tr->starts, sizeof(int) * (tr->numKeys + 1));
+    tr->starts[tr->numKeys++] = tr->len;
+    tr->b = realloc(tr->b, tr->len + len);
+    memcpy(&tr->b[tr->len], s, len);
+    tr->len += len;
+}
+
+void traceChar(trace *tr, char c) {
+    traceKey(tr, &c, 1);
+}
+
+void traceFree(trace *tr) {
+    free(tr->b);
+    free(tr->starts);
+}
+
+#define ESC_UP "\x1b[A"
+#define ESC_DOWN "\x1b[B"
+#define ESC_PAGE_UP "\x1b[5~"
+#define ESC_PAGE_DOWN "\x1b[6~"
+
+const char *benchText = "the quick brown fox jumps over the lazy dog\t";
+
+void traceTyping(trace *tr) {
+    for (int i = 0; i < 2000; ++i) {
+        if (i % 60 == 59) traceChar(tr, '\r');
+        else if (i % 17 == 16) traceChar(tr, BACKSPACE);
+        else traceChar(tr, benchText[i % strlen(benchText)]);
+    }
+}
+
+void tracePaste(trace *tr) {
+    /* without bracketed paste a paste is just a fast burst of keys */
+    for (int i = 0; i < 16 * 1024; ++i)
+        traceChar(tr, i % 72 == 71 ? '\r' : benchText[i % strlen(benchText)]);
+}
+
+void traceScroll(trace *tr) {
+    for (int i = 0; i < 100; ++i) traceKey(tr, ESC_PAGE_DOWN, 4);
+    for (int i = 0; i < 1000; ++i) traceKey(tr, ESC_DOWN, 3);
+    for (int i = 0; i < 100; ++i) traceKey(tr, ESC_PAGE_UP, 4);
+}
+
+void traceSearch(trace *tr) {
+    traceChar(tr, CTRL_KEY('f'));
+    for (const char *q = "needle"; *q; ++q) traceChar(tr, *q);
+    for (int i = 0; i < 50; ++i) traceKey(tr, ESC_DOWN, 3);
+    for (int i = 0; i < 10; ++i) traceKey(tr, ESC_UP, 3);
+    traceChar(tr, '\r');
+}
+
+void traceSave(trace *tr) {
+    traceChar(tr, CTRL_KEY('s'));
+}
+
+/* record "comment out this line" and apply it to every line of the file */
+void traceMacro(trace *tr) {
+    traceChar(tr, CTRL_KEY('o'));
+    traceKey(tr, "\x1b[H", 3);
+    traceChar(tr, '#');
+    traceChar(tr, ' ');
+    traceChar(tr, CTRL_KEY('o'));
+    traceChar(tr, CTRL_KEY('e'));
+    char range[32];
+    int len = snprintf(range, sizeof(range), "1,%d", E.numRows);
+    for (int i = 0; i < len; ++i) traceChar(tr, range[i]);
+    traceChar(tr, '\r');
+}
+
+typedef struct {
+    const char *name;
+    void (*build)(trace *tr);
+} benchTrace;
+
+benchTrace benchTraces[] = {
+    {"typing", traceTyping},
+    {"paste", tracePaste},
+    {"scroll", traceScroll},
+    {"search", traceSearch},
+    {"save", traceSave},
+    {"macro", traceMacro},
+};
+
+/*** measurement ***/
+
+long benchElapsedNs(struct timespec *a, struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) * 1000000000L + (b->tv_nsec - a->tv_nsec);
+}
+
+int benchCmpLong(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+/* replay one trace and print its stats as a JSON object */
+void benchRun(benchTrace *bt) {
+    trace tr = {NULL, 0, NULL, 0};
+    bt->build(&tr);
+
+    B.tr = &tr;
+    B.pos = 0;
+    B.key = 0;
+    B.paused = 0;
+    B.keyTime = malloc(sizeof(struct timespec) * (tr.numKeys + 1));
+    B.keyBytes = malloc(sizeof(long) * (tr.numKeys + 1));
+
+    while (B.pos < tr.len) {
+        editorProcessKeypress();
+        editorRefreshScreen();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &B.keyTime[tr.numKeys]);
+    B.keyBytes[tr.numKeys] = B.written;
+
+    long *lat = malloc(sizeof(long) * tr.numKeys);
+    long totalBytes = 0, maxBytes = 0;
+    for (int k = 0; k < tr.numKeys; ++k) {
+        lat[k] = benchElapsedNs(&B.keyTime[k], &B.keyTime[k + 1]);
+        long bytes = B.keyBytes[k + 1] - B.keyBytes[k];
+        totalBytes += bytes;
+        if (bytes > maxBytes) maxBytes = bytes;
+    }
+    qsort(lat, tr.numKeys, sizeof(long), benchCmpLong);
+
+    printf("{\"name\": \"%s\", \"keys\": %d, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+           "\"max_us\": %.1f, \"bytes_per_frame_avg\": %.1f, \"bytes_per_frame_max\": %ld}",
+           bt->name, tr.numKeys,
+           lat[tr.numKeys / 2] / 1000.0,
+           lat[(long)tr.numKeys * 99 / 100] / 1000.0,
+           lat[tr.numKeys - 1] / 1000.0,
+           (double)totalBytes / tr.numKeys, maxBytes);
+
+    free(lat);
+    free(B.keyTime);
+    free(B.keyBytes);
+    traceFree(&tr);
+}
+
+/*** synthetic files ***/
+
+/* write `size` bytes of lines with varied lengths, tabs and rare needles */
+int benchMakeFile(char *path, long size) {
+    int fd = mkstemp(path);
+    if (fd == -1) return -1;
+    FILE *fp = fdopen(fd, "w");
+
+    unsigned int seed = 42;
+    long left = size;
+    while (left > 0) {
+        char line[160];
+        int len = 0;
+        seed = seed * 1103515245 + 12345;
+        int want = (seed >> 16) % 120;
+        if ((seed >> 8) % 20 == 0) line[len++] = '\t';
+        if ((seed >> 4) % 997 == 0) {
+            memcpy(&line[len], "needle ", 7);
+            len += 7;
+        }
+        while (len < want) {
+            seed = seed * 1103515245 + 12345;
+            line[len++] = "abcdefghijklmnopqrstuvwxyz ,.;()"[(seed >> 16) % 32];
+        }
+        line[len++] = '\n';
+        if (len > left) {
+            len = left;
+            line[len - 1] = '\n';
+        }
+        fwrite(line, 1, len, fp);
+        left -= len;
+    }
+    return fclose(fp);
+}
+
+long benchParseSize(const char *s, char **end) {
+    long n = strtol(s, end, 10);
+    switch (**end) {
+        case 'K': case 'k': n <<= 10; ++*end; break;
+        case 'M': case 'm': n <<= 20; ++*end; break;
+        case 'G': case 'g': n <<= 30; ++*end; break;
+    }
+    return n;
+}
+
+/* run every trace on one file size, in a child so peak RSS is per size */
+void benchSize(long size) {
+    const char *dir = getenv("TMPDIR");
+    char path[256];
+    snprintf(path, sizeof(path), "%s/kilo-bench-XXXXXX", dir ? dir : "/tmp");
+    if (benchMakeFile(path, size) == -1) die("benchMakeFile");
+
+    T.read = benchRead;
+    T.write = benchWrite;
+    T.windowSize = benchWindowSize;
+    initEditor();
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    editorOpen(path);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    printf("{\"size\": %ld, \"rows\": %d, \"open_ms\": %.1f, \"traces\": [",
+           size, E.numRows, benchElapsedNs(&t0, &t1) / 1e6);
+
+    int numTraces = sizeof(benchTraces) / sizeof(benchTraces[0]);
+    for (int i = 0; i < numTraces; ++i) {
+        /* start every trace from the middle of the file */
+        E.cy = E.numRows / 2;
+        E.cx = 0;
+        printf("%s", i ? ", " : "");
+        benchRun(&benchTraces[i]);
+    }
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printf("], \"peak_rss_kb\": %ld}", ru.ru_maxrss);
+    fflush(stdout);
+    unlink(path);
+}
+
+int main(int argc, char *argv[]) {
+    const char *sizes = BENCH_DEFAULT_SIZES;
+    B.rows = 24;
+    B.cols = 80;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (!strcmp(argv[i], "--sizes")) sizes = argv[i + 1];
+        else if (!strcmp(argv[i], "--rows")) B.rows = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "--cols")) B.cols = atoi(argv[i + 1]);
+    }
+
+    printf("{\"term\": {\"rows\": %d, \"cols\": %d}, \"runs\": [", B.rows, B.cols);
+    fflush(stdout);
+
+    const char *p = sizes;
+    int first = 1;
+    while (*p) {
+        char *end;
+        long size = benchParseSize(p, &end);
+        if (end == p || size <= 0) {
+            fprintf(stderr, "kilo-bench: bad size list '%s'\n", sizes);
+            return 1;
+        }
+
+        if (!first) printf(", ");
+        fflush(stdout);
+        first = 0;
+
+        pid_t pid = fork();
+        if (pid == -1) die("fork");
+        if (pid == 0) {
+            benchSize(size);
+            _exit(0);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "kilo-bench: run for %ld bytes failed\n", size);
+            return 1;
+        }
+
+        p = (*end == ',') ? end + 1 : end;
+    }
+    printf("]}\n");
+    return 0;
+}
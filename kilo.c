@@ -8,11 +8,15 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <regex.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <termios.h>
 #include <time.h>
@@ -23,6 +27,13 @@
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 3
+#define KILO_UNDO_LEVELS 16
+#define KILO_KILL_RING 8
+#define KILO_INDEX_BLOCK 256 // rows per line index block, split at twice that
+#define KILO_MAX_THREADS 16
+#define KILO_PARALLEL_MIN_ROWS 65536 // smaller buffers are processed serially
+#define KILO_CHECK_INTERVAL 2 // seconds between checks for changes on disk
+#define KILO_RELOAD_MAX_EDITS 2000 // past this a reload diffs between unique lines
 
 
 #define CTRL_KEY(k) ((k) & 0x1f)
@@ -37,7 +48,9 @@ enum editorKey {
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    FOCUS_IN,
+    FOCUS_OUT
 };
 
 /*** data ***/
@@ -45,10 +58,68 @@ enum editorKey {
 typedef struct {
     int size;
     int rsize; // render size
-    char *chars;
+    char *chars; // reference counted, see rowCharsAlloc()
     char *render;
 } erow;
 
+/* one line of a copied block, pointing into shared row storage */
+typedef struct {
+    char *chars; // shared row chars, NULL for an empty line
+    int off, len;
+    int whole; // covers all of chars, so it can be pasted as a row as is
+} clipLine;
+
+typedef struct {
+    clipLine *lines;
+    int numLines;
+} clip;
+
+/* keys recorded from editorReadKey, and replayed through it */
+typedef struct {
+    int *keys;
+    int len, cap;
+    int recording;
+    int playing; // editorReadKey serves keys[pos] instead of the terminal
+    int pos;
+} keyMacro;
+
+/* one of several cursors, with an optional selection within its row */
+typedef struct {
+    int cx, cy;
+    int ax; // other end of the selection, == cx when there is none
+    int rx; // render column to aim for when moving up or down
+} cursor;
+
+/* rows in consecutive blocks, with Fenwick trees over the blocks' row */
+/* counts and byte sizes (row lengths +1 for '\n') */
+typedef struct {
+    int *count; // rows in each block
+    long *bytes; // bytes in each block
+    int *countTree; // 1-indexed Fenwick trees over count and bytes
+    long *bytesTree;
+    char *stale; // per block: a row changed length, recount before lookups
+    int *staleList;
+    int numStale;
+    int blocks, cap;
+    int valid; // cleared by bulk row changes
+} lineIndex;
+
+enum undoKind {
+    UNDO_ROWS = 0, // rows rewritten in place
+    UNDO_PERMUTE, // rows [at, at + n) reordered
+    UNDO_REMOVE // rows deleted
+};
+
+/* a bulk operation that can be undone as a whole */
+typedef struct {
+    int kind;
+    int n; // number of saved rows, or of permuted rows
+    int at; // UNDO_PERMUTE: first permuted row
+    int *idx; // UNDO_ROWS, UNDO_REMOVE: index of each saved row
+              // UNDO_PERMUTE: row at + i came from at + idx[i]
+    erow *rows; // the rows as they were before the operation, if any
+} undoEntry;
+
 typedef struct {
     /* cx: horizontal index of cursor in file */
     /* cy: vertical index of cursor in file */
@@ -60,6 +131,27 @@ typedef struct {
     int screenCols;
     int numRows; // number of rows in file
     erow *row;
+    lineIndex lineIdx; // prefix sums of row lengths, for byte offsets
+    undoEntry undo[KILO_UNDO_LEVELS]; // bulk operations, most recent last
+    int numUndo;
+    int markSet; // a selection runs from the mark to the cursor
+    int markX, markY;
+    clip kill[KILO_KILL_RING]; // kill ring, most recent first
+    int numKill;
+    int yanked; // the last command was a paste, so it can be cycled
+    int yankIdx; // kill ring entry that was pasted
+    int yankX, yankY; // where that paste started
+    cursor *cursors; // multi-cursor editing, sorted by position
+    int numCursors; // 0 when there is only the regular cursor
+    int primary; // index of the cursor tracked by cx, cy
+    keyMacro macro;
+    int batch; // rendering suspended, e.g. while a macro replays
+    int prompting; // inside editorPrompt
+    struct timespec fileMtime; // the file as last read or written
+    off_t fileSize;
+    int fileStatValid;
+    int fileChanged; // changed on disk since, and the user was told
+    time_t lastCheck;
     int dirty;
     char *filename;
     char statusmsg[80];
@@ -70,18 +162,182 @@ typedef struct {
 
 editorConfig E;
 
+/* terminal I/O, the real tty unless a driver swaps it out (see bench.c) */
+typedef struct {
+    ssize_t (*read)(int fd, void *buf, size_t len);
+    ssize_t (*write)(int fd, const void *buf, size_t len);
+    int (*windowSize)(int *rows, int *cols);
+} termBackend;
+
+#ifdef KILO_STATS
+/* hot-path timers and counters, compiled out unless built with -DKILO_STATS */
+enum statTimerId {
+    STAT_REFRESH = 0,
+    STAT_KEYPRESS,
+    STAT_OPEN,
+    STAT_SAVE,
+    STAT_FIND,
+    STAT_TIMERS
+};
+
+typedef struct {
+    long calls;
+    long totalNs;
+    long maxNs;
+} statTimer;
+
+typedef struct {
+    statTimer timers[STAT_TIMERS];
+    long frameHist[32]; // bucket i counts frames taking [2^i, 2^(i+1)) us
+    long frames;
+    long termIO; // terminal reads that returned data, and writes
+    long waitNs; // spent in prompts waiting for the user, left out of timers
+    long bytesOut; // bytes written to the terminal by refreshes
+    long allocs;
+    long rowsRendered; // editorUpdateRow calls
+    long rowsDrawn; // file rows drawn to the screen
+    int overlay; // show stats in the message bar
+} editorStats;
+
+editorStats S;
+
+#define STAT_INC(field, n) ((void)__atomic_fetch_add(&S.field, (n), __ATOMIC_RELAXED))
+#define STAT_BEGIN(id) long statStart_##id = statNow() - S.waitNs
+#define STAT_END(id) statRecord(id, statStart_##id)
+#define STAT_WAIT_BEGIN() long statWaitStart = statNow()
+#define STAT_WAIT_END() (S.waitNs += statNow() - statWaitStart)
+#else
+#define STAT_INC(field, n) ((void)0)
+#define STAT_BEGIN(id)
+#define STAT_END(id)
+#define STAT_WAIT_BEGIN()
+#define STAT_WAIT_END()
+#endif
+
+/* the editor allocates through these so stats builds can count every */
+/* allocation, worker threads included */
+#define editorMalloc(n) (STAT_INC(allocs, 1), malloc(n))
+#define editorRealloc(p, n) (STAT_INC(allocs, 1), realloc(p, n))
+#define editorCalloc(n, size) (STAT_INC(allocs, 1), calloc(n, size))
+#define editorStrdup(s) (STAT_INC(allocs, 1), strdup(s))
+
 /*** prototype ***/
 
+int getWindowSize(int *rows, int *cols);
+
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
+void editorProcessKeypress();
+void editorCheckFileTimer();
 char *editorPrompt(char *prompt, void (*callback)(char*, int));
+char *editorPromptOpt(char *prompt, void (*callback)(char*, int), int allowEmpty);
+
+#ifdef KILO_STATS
+long statNow();
+void statRecord(int id, long startNs);
+ssize_t statRead(int fd, void *buf, size_t len);
+ssize_t statWrite(int fd, const void *buf, size_t len);
+
+termBackend T = {statRead, statWrite, getWindowSize};
+#else
+termBackend T = {read, write, getWindowSize};
+#endif
+
+/*** stats ***/
+
+#ifdef KILO_STATS
+long statNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* startNs has the wait time so far taken off, see STAT_BEGIN */
+void statRecord(int id, long startNs) {
+    long ns = statNow() - S.waitNs - startNs;
+    statTimer *t = &S.timers[id];
+    t->calls++;
+    t->totalNs += ns;
+    if (ns > t->maxNs) t->maxNs = ns;
+
+    if (id == STAT_REFRESH) {
+        int bucket = 0;
+        for (long us = ns / 1000; us > 1 && bucket < 31; us >>= 1) ++bucket;
+        S.frameHist[bucket]++;
+        S.frames++;
+    }
+}
+
+ssize_t statRead(int fd, void *buf, size_t len) {
+    ssize_t n = read(fd, buf, len);
+    if (n > 0) S.termIO++;
+    return n;
+}
+
+ssize_t statWrite(int fd, const void *buf, size_t len) {
+    S.termIO++;
+    return write(fd, buf, len);
+}
+
+/* upper bound in us of the bucket holding the p-th frame time percentile */
+long statFramePercentile(double p) {
+    long want = S.frames * p, seen = 0;
+    for (int i = 0; i < 32; ++i) {
+        seen += S.frameHist[i];
+        if (seen > want) return 2L << i;
+    }
+    return 0;
+}
+
+double statPerFrame(long n) {
+    return S.frames ? (double)n / S.frames : 0;
+}
+
+int statFormat(char *buf, int size) {
+    statTimer *key = &S.timers[STAT_KEYPRESS];
+    return snprintf(buf, size,
+            "%ld frames p50<%ldus p99<%ldus | per frame: %.1f term io %.0f B %.1f rows"
+            " | %ld allocs | key avg %.0fus",
+            S.frames, statFramePercentile(0.5), statFramePercentile(0.99),
+            statPerFrame(S.termIO), statPerFrame(S.bytesOut),
+            statPerFrame(S.rowsRendered), S.allocs,
+            key->calls ? key->totalNs / 1000.0 / key->calls : 0);
+}
+
+/* write all counters as JSON to $KILO_STATS_FILE on exit */
+void statDump() {
+    const char *path = getenv("KILO_STATS_FILE");
+    if (path == NULL) return;
+    FILE *fp = fopen(path, "w");
+    if (!fp) return;
+
+    const char *names[STAT_TIMERS] = {"refresh", "keypress", "open", "save", "find"};
+    fprintf(fp, "{\"timers\": {");
+    for (int i = 0; i < STAT_TIMERS; ++i) {
+        statTimer *t = &S.timers[i];
+        fprintf(fp, "%s\"%s\": {\"calls\": %ld, \"total_us\": %ld, \"max_us\": %ld}",
+                i ? ", " : "", names[i], t->calls, t->totalNs / 1000, t->maxNs / 1000);
+    }
+    fprintf(fp, "}, \"frame_hist_us\": {");
+    int first = 1;
+    for (int i = 0; i < 32; ++i) {
+        if (!S.frameHist[i]) continue;
+        fprintf(fp, "%s\"<%ld\": %ld", first ? "" : ", ", 2L << i, S.frameHist[i]);
+        first = 0;
+    }
+    fprintf(fp, "}, \"frames\": %ld, \"term_io\": %ld, \"bytes_out\": %ld, "
+            "\"allocs\": %ld, \"rows_rendered\": %ld, \"rows_drawn\": %ld}\n",
+            S.frames, S.termIO, S.bytesOut, S.allocs, S.rowsRendered, S.rowsDrawn);
+    fclose(fp);
+}
+#endif
 
 /*** terminal ***/
 
 /* error handling */
 void die(const char *s) {
-    write(STDIN_FILENO, "\x1b[2J", 4);
-    write(STDIN_FILENO, "\x1b[H", 3);
+    T.write(STDIN_FILENO, "\x1b[2J", 4);
+    T.write(STDIN_FILENO, "\x1b[H", 3);
 
     /* print s then exit with code 1 */
     perror(s);
@@ -90,6 +346,7 @@ void die(const char *s) {
 
 /* disable raw mode (return to canonical mode)*/
 void disableRawMode() {
+    T.write(STDOUT_FILENO, "\x1b[?1004l", 8); // stop focus reporting
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
         die("tcsetattr");
 }
@@ -133,13 +390,17 @@ void enableRawMode() {
     /* apply to your terminal with tcsetattr and TCSAFLUSH */
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) 
         die("tcsetattr");
+
+    /* ask the terminal to report focus changes as \x1b[I and \x1b[O */
+    T.write(STDOUT_FILENO, "\x1b[?1004h", 8);
 }
 
-int editorReadKey() {
+int editorReadTermKey() {
     int nread;
     char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
+    while ((nread = T.read(STDIN_FILENO, &c, 1)) != 1) {
         if (nread == -1 && errno != EAGAIN) die("read");
+        if (nread == 0) editorCheckFileTimer(); // idle
     }
     
 
@@ -154,12 +415,12 @@ int editorReadKey() {
         /* PgDn: /x1b[7~ */
         char seq[3];
 
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+        if (T.read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
+        if (T.read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
 
         if (seq[0] == '[') {
             if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+                if (T.read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
                 if (seq[2] == '~') {
                     switch (seq[1]) {
                         case '1': return HOME_KEY;
@@ -180,6 +441,7 @@ int editorReadKey() {
                 /* Left: /x1b[D */
                 /* Home: /x1b[H */
                 /* End: /x1b[F */
+                /* Focus in/out: /x1b[I /x1b[O */
                 switch (seq[1]) {
                     case 'A': return ARROW_UP;
                     case 'B': return ARROW_DOWN;
@@ -187,6 +449,8 @@ int editorReadKey() {
                     case 'D': return ARROW_LEFT;
                     case 'H': return HOME_KEY;
                     case 'F': return END_KEY;
+                    case 'I': return FOCUS_IN;
+                    case 'O': return FOCUS_OUT;
                 }
             }
         }
@@ -205,15 +469,33 @@ int editorReadKey() {
 
 }
 
+/* next key, from a replaying macro or the terminal (and then recorded) */
+int editorReadKey() {
+    keyMacro *m = &E.macro;
+    if (m->playing) {
+        /* a prompt left open at the end of the macro gets cancelled */
+        return m->pos < m->len ? m->keys[m->pos++] : '\x1b';
+    }
+    int c = editorReadTermKey();
+    if (m->recording && c != FOCUS_IN && c != FOCUS_OUT) {
+        if (m->len == m->cap) {
+            m->cap = m->cap ? m->cap * 2 : 64;
+            m->keys = editorRealloc(m->keys, sizeof(int) * m->cap);
+        }
+        m->keys[m->len++] = c;
+    }
+    return c;
+}
+
 int getCursorPosition(int *rows, int *cols) {
     char buf[32];
     unsigned int i = 0;
 
-    if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1; //  VT100 cursor position report 
+    if (T.write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1; //  VT100 cursor position report 
 
     printf("\r\n");
     while (i < sizeof(buf) - 1) {
-        if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
+        if (T.read(STDIN_FILENO, &buf[i], 1) != 1) break;
         if (buf[i] == 'R') break;
         ++i;
     }
@@ -231,7 +513,7 @@ int getWindowSize(int *rows, int *cols) {
     if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
         /*ioctl doesn't guarantee to work on all system*/
         /*so we move the cursor to the last cell and report the cursor position*/
-        if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) return -1;
+        if (T.write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) return -1;
         return getCursorPosition(rows, cols); 
     }
     else {
@@ -241,6 +523,287 @@ int getWindowSize(int *rows, int *cols) {
     }
 }
 
+/*** threads ***/
+
+typedef struct {
+    void (*fn)(void *arg, int part, int lo, int hi);
+    void *arg;
+    int part, lo, hi;
+} parallelTask;
+
+void *parallelWorker(void *p) {
+    parallelTask *t = p;
+    t->fn(t->arg, t->part, t->lo, t->hi);
+    return NULL;
+}
+
+/* number of parts editorParallelFor splits n rows into */
+int editorParallelParts(int n) {
+    if (n < KILO_PARALLEL_MIN_ROWS) return 1;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) cpus = 1;
+    return cpus > KILO_MAX_THREADS ? KILO_MAX_THREADS : cpus;
+}
+
+/* call fn on `parts` consecutive slices of [0, n), each on its own thread */
+/* fn must not touch editor state besides the rows of its own slice */
+void editorParallelSplit(int n, int parts,
+                         void (*fn)(void *arg, int part, int lo, int hi), void *arg) {
+    parallelTask tasks[KILO_MAX_THREADS];
+    pthread_t threads[KILO_MAX_THREADS];
+    int started[KILO_MAX_THREADS];
+
+    for (int i = 0; i < parts; ++i) {
+        tasks[i].fn = fn;
+        tasks[i].arg = arg;
+        tasks[i].part = i;
+        tasks[i].lo = (long)n * i / parts;
+        tasks[i].hi = (long)n * (i + 1) / parts;
+        /* the last slice runs here, as does any slice that can't get a thread */
+        started[i] = (i < parts - 1) &&
+            pthread_create(&threads[i], NULL, parallelWorker, &tasks[i]) == 0;
+    }
+    for (int i = 0; i < parts; ++i)
+        if (!started[i]) parallelWorker(&tasks[i]);
+    for (int i = 0; i < parts; ++i)
+        if (started[i]) pthread_join(threads[i], NULL);
+}
+
+void editorParallelFor(int n, void (*fn)(void *arg, int part, int lo, int hi), void *arg) {
+    editorParallelSplit(n, editorParallelParts(n), fn, arg);
+}
+
+/* glibc's regexec locks the pattern it runs, so a pattern shared by */
+/* workers would match one row at a time. Check it once here, reporting */
+/* errors in the message bar, then let each worker compile its own copy */
+/* with editorRegexWorker. Returns the number of groups, -1 on error. */
+int editorRegexCheck(const char *pattern, int flags) {
+    regex_t re;
+    int err = regcomp(&re, pattern, flags);
+    if (err) {
+        char msg[64];
+        regerror(err, &re, msg, sizeof(msg));
+        editorSetStatusMessage("Bad regex: %s", msg);
+        return -1;
+    }
+    int nsub = re.re_nsub;
+    regfree(&re);
+    return nsub;
+}
+
+/* a worker's own copy of a pattern editorRegexCheck accepted */
+void editorRegexWorker(regex_t *re, const char *pattern, int flags) {
+    regcomp(re, pattern, flags);
+}
+
+/*** line index ***/
+
+void lineIndexBuildTrees() {
+    lineIndex *li = &E.lineIdx;
+    for (int i = 1; i <= li->blocks; ++i) {
+        li->countTree[i] = li->count[i - 1];
+        li->bytesTree[i] = li->bytes[i - 1];
+    }
+    /* push every node's partial sum up into its parent */
+    for (int i = 1; i <= li->blocks; ++i) {
+        int parent = i + (i & -i);
+        if (parent <= li->blocks) {
+            li->countTree[parent] += li->countTree[i];
+            li->bytesTree[parent] += li->bytesTree[i];
+        }
+    }
+}
+
+void lineIndexReserve(int blocks) {
+    lineIndex *li = &E.lineIdx;
+    if (blocks <= li->cap) return;
+    li->cap = blocks * 2;
+    li->count = editorRealloc(li->count, sizeof(int) * li->cap);
+    li->bytes = editorRealloc(li->bytes, sizeof(long) * li->cap);
+    li->countTree = editorRealloc(li->countTree, sizeof(int) * (li->cap + 1));
+    li->bytesTree = editorRealloc(li->bytesTree, sizeof(long) * (li->cap + 1));
+    li->stale = editorRealloc(li->stale, li->cap);
+    li->staleList = editorRealloc(li->staleList, sizeof(int) * li->cap);
+}
+
+long lineIndexSum(int from, int n) {
+    long sum = 0;
+    for (int j = from; j < from + n; ++j) sum += E.row[j].size + 1;
+    return sum;
+}
+
+/* rebuild the whole index in O(n), after bulk operations */
+void lineIndexRebuild() {
+    lineIndex *li = &E.lineIdx;
+    li->blocks = E.numRows / KILO_INDEX_BLOCK + 1; // the last one may be empty
+    lineIndexReserve(li->blocks);
+    for (int k = 0; k < li->blocks; ++k) {
+        int from = k * KILO_INDEX_BLOCK;
+        li->count[k] = E.numRows - from < KILO_INDEX_BLOCK ? E.numRows - from
+                                                           : KILO_INDEX_BLOCK;
+        li->bytes[k] = lineIndexSum(from, li->count[k]);
+        li->stale[k] = 0;
+    }
+    li->numStale = 0;
+    lineIndexBuildTrees();
+    li->valid = 1;
+}
+
+/* rows were changed in bulk, rebuild lazily on the next lookup */
+void lineIndexInvalidate() {
+    E.lineIdx.valid = 0;
+}
+
+void lineIndexAdd(int k, int rows, long bytes) {
+    lineIndex *li = &E.lineIdx;
+    li->count[k] += rows;
+    li->bytes[k] += bytes;
+    for (int i = k + 1; i <= li->blocks; i += i & -i) {
+        li->countTree[i] += rows;
+        li->bytesTree[i] += bytes;
+    }
+}
+
+/* the block holding row `at`, and in *start its first row */
+int lineIndexFind(int at, int *start) {
+    lineIndex *li = &E.lineIdx;
+    int pos = 0, step = 1;
+    while (step * 2 <= li->blocks) step *= 2;
+    for (; step > 0; step >>= 1) {
+        if (pos + step <= li->blocks && li->countTree[pos + step] <= at) {
+            pos += step;
+            at -= li->countTree[pos];
+        }
+    }
+    *start = -at; // at is now relative to the block
+    return pos;
+}
+
+/* recount block k's bytes from its rows */
+void lineIndexResum(int k, int start) {
+    lineIndex *li = &E.lineIdx;
+    lineIndexAdd(k, 0, lineIndexSum(start, li->count[k]) - li->bytes[k]);
+}
+
+/* recount the blocks of rows that changed length since the last lookup */
+void lineIndexFlush() {
+    lineIndex *li = &E.lineIdx;
+    for (int s = 0; s < li->numStale; ++s) {
+        int k = li->staleList[s];
+        int start = 0;
+        for (int i = k; i > 0; i -= i & -i)
+            start += li->countTree[i];
+        lineIndexResum(k, start);
+        li->stale[k] = 0;
+    }
+    li->numStale = 0;
+}
+
+/* split a block that grew past twice the block size, O(blocks) */
+void lineIndexSplit(int k, int start) {
+    lineIndex *li = &E.lineIdx;
+    lineIndexReserve(li->blocks + 1);
+    memmove(&li->count[k + 1], &li->count[k], sizeof(int) * (li->blocks - k));
+    memmove(&li->bytes[k + 1], &li->bytes[k], sizeof(long) * (li->blocks - k));
+    li->blocks++;
+    li->stale[li->blocks - 1] = 0;
+    int n = li->count[k];
+    li->count[k] = n / 2;
+    li->count[k + 1] = n - n / 2;
+    li->bytes[k] = lineIndexSum(start, n / 2);
+    li->bytes[k + 1] = lineIndexSum(start + n / 2, n - n / 2);
+    lineIndexBuildTrees();
+}
+
+/* n rows were inserted at `at` */
+void lineIndexInsert(int at, int n) {
+    lineIndex *li = &E.lineIdx;
+    if (!li->valid) return;
+    if (n > KILO_INDEX_BLOCK) {
+        lineIndexInvalidate();
+        return;
+    }
+    /* grow the block holding the row before them */
+    int start = 0;
+    int k = at > 0 ? lineIndexFind(at - 1, &start) : 0;
+    if (k >= li->blocks) k = li->blocks - 1;
+    if (at > 0) start += at - 1;
+    lineIndexAdd(k, n, 0);
+    lineIndexResum(k, start);
+    lineIndexFlush(); // the counts match the rows again
+    if (li->count[k] > 2 * KILO_INDEX_BLOCK) lineIndexSplit(k, start);
+}
+
+/* n rows were deleted at `at` */
+void lineIndexDelete(int at, int n) {
+    lineIndex *li = &E.lineIdx;
+    if (!li->valid) return;
+    if (n > KILO_INDEX_BLOCK) {
+        lineIndexInvalidate();
+        return;
+    }
+    /* shrink each block they were in, their rows have already moved up */
+    while (n > 0) {
+        int start;
+        int k = lineIndexFind(at, &start);
+        start += at;
+        int m = start + li->count[k] - at;
+        if (m > n) m = n;
+        lineIndexAdd(k, -m, 0);
+        lineIndexResum(k, start);
+        n -= m;
+    }
+    lineIndexFlush();
+}
+
+/* byte offset of the first char of row `at` */
+long lineIndexOffset(int at) {
+    if (!E.lineIdx.valid) lineIndexRebuild();
+    lineIndexFlush();
+    lineIndex *li = &E.lineIdx;
+    if (at > E.numRows) at = E.numRows;
+    int start;
+    int k = lineIndexFind(at, &start);
+    start += at;
+    long sum = 0;
+    for (int i = k; i > 0; i -= i & -i)
+        sum += li->bytesTree[i];
+    return sum + lineIndexSum(start, at - start);
+}
+
+/* index of the row containing byte `offset`, E.numRows if past the end */
+int lineIndexRow(long offset) {
+    if (!E.lineIdx.valid) lineIndexRebuild();
+    lineIndexFlush();
+    lineIndex *li = &E.lineIdx;
+    int pos = 0, step = 1, row = 0;
+    while (step * 2 <= li->blocks) step *= 2;
+    for (; step > 0; step >>= 1) {
+        if (pos + step <= li->blocks && li->bytesTree[pos + step] <= offset) {
+            pos += step;
+            offset -= li->bytesTree[pos];
+            row += li->countTree[pos];
+        }
+    }
+    while (row < E.numRows && offset >= E.row[row].size + 1) {
+        offset -= E.row[row].size + 1;
+        ++row;
+    }
+    return row;
+}
+
+/* row `at` changed length, its block is recounted on the next lookup so */
+/* a burst of edits in one block costs a single recount */
+void lineIndexUpdate(int at) {
+    lineIndex *li = &E.lineIdx;
+    if (!li->valid || at < 0 || at >= E.numRows) return;
+    int start;
+    int k = lineIndexFind(at, &start);
+    if (li->stale[k]) return;
+    li->stale[k] = 1;
+    li->staleList[li->numStale++] = k;
+}
+
 /*** row operations ***/
 
 /* convert chars index to render index */
@@ -257,151 +820,1591 @@ int editorRowCxToRx(erow* row, int cx) {
 int editorRowRxToCx(erow *row, int rx) {
     int cur_rx = 0;
     int cx;
-    for (cx = 0; cx < row->size; cx++, cur_rx++) {
+    for (cx = 0; cx < row->size; cx++) {
         if (row->chars[cx] == '\t') cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
+        cur_rx++;
         if (cur_rx > rx) return cx;
     }
     return cx;
 }
 
-/* render tabs with size KILO_TAB_STOP */
-void editorUpdateRow(erow *row) {
+/* render tabs with size KILO_TAB_STOP, safe to call from worker threads */
+void editorRenderRow(erow *row) {
     int tabs = 0;
     int j;
     for (int j = 0; j < row->size; ++j) {
         if (row->chars[j] == '\t') ++tabs;
     }
 
-    free(row->render);
-    row->render = malloc(row->size + tabs * (KILO_TAB_STOP - 1) + 1);
+    STAT_INC(rowsRendered, 1);
+    free(row->render);
+    row->render = editorMalloc(row->size + tabs * (KILO_TAB_STOP - 1) + 1);
+
+    int idx = 0;
+    for (j = 0; j < row->size; ++j) {
+        if (row->chars[j] == '\t') {
+            row->render[idx++] = ' ';
+            while (idx % 8 != 0) row->render[idx++] = ' ';
+        }
+        else {
+            row->render[idx++] = row->chars[j];
+        }
+    }
+    row->render[idx] = '\0';
+    row->rsize = idx;
+}
+
+/* re-render a row of E.row after its chars changed */
+void editorUpdateRow(erow *row) {
+    editorRenderRow(row);
+    lineIndexUpdate(row - E.row);
+}
+
+/* row chars carry a reference count in front, so the kill ring can share */
+/* them; a shared buffer is immutable until editorRowUnshare() copies it */
+#define ROW_HDR sizeof(long)
+#define ROW_REFS(chars) (*(long *)((chars) - ROW_HDR))
+
+char *rowCharsAlloc(size_t size) {
+    char *p = editorMalloc(ROW_HDR + size);
+    *(long *)p = 1;
+    return p + ROW_HDR;
+}
+
+char *rowCharsRealloc(char *chars, size_t size) {
+    char *p = editorRealloc(chars - ROW_HDR, ROW_HDR + size);
+    return p + ROW_HDR;
+}
+
+char *rowCharsShare(char *chars) {
+    ROW_REFS(chars)++;
+    return chars;
+}
+
+void rowCharsRelease(char *chars) {
+    if (chars && --ROW_REFS(chars) == 0) free(chars - ROW_HDR);
+}
+
+/* take a private copy of the chars before modifying them in place */
+void editorRowUnshare(erow *row) {
+    if (ROW_REFS(row->chars) == 1) return;
+    char *chars = rowCharsAlloc(row->size + 1);
+    memcpy(chars, row->chars, row->size);
+    chars[row->size] = '\0';
+    rowCharsRelease(row->chars);
+    row->chars = chars;
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+    if (at < 0 || at > E.numRows) return;
+
+    E.row = editorRealloc(E.row, sizeof(erow) * (E.numRows + 1));
+    memmove(&E.row[at+1], &E.row[at], sizeof(erow) * (E.numRows - at));
+
+    E.row[at].size = len;
+    E.row[at].chars = rowCharsAlloc(len + 1);
+    memcpy(E.row[at].chars, s, len);
+    E.row[at].chars[len] = '\0';
+
+    E.row[at].rsize = 0;
+    E.row[at].render = NULL;
+    editorRenderRow(&E.row[at]);
+
+    E.numRows++;
+    lineIndexInsert(at, 1);
+    E.dirty++;
+}
+
+void editorFreeRow(erow *row) {
+    free(row->render);
+    rowCharsRelease(row->chars);
+}
+
+void editorDelRow(int at) {
+    if (at < 0 || at >= E.numRows) return;
+    editorFreeRow(&E.row[at]);
+    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numRows - at - 1));
+    E.numRows--;
+    lineIndexDelete(at, 1);
+    E.dirty++;
+}
+
+/* insert n already rendered rows at once, taking ownership of them */
+void editorInsertRows(int at, erow *rows, int n) {
+    if (at < 0 || at > E.numRows || n <= 0) return;
+    E.row = editorRealloc(E.row, sizeof(erow) * (E.numRows + n));
+    memmove(&E.row[at + n], &E.row[at], sizeof(erow) * (E.numRows - at));
+    memcpy(&E.row[at], rows, sizeof(erow) * n);
+    E.numRows += n;
+    lineIndexInsert(at, n);
+    E.dirty++;
+}
+
+/* delete rows [at, at + n) with a single move of the rows after them */
+void editorDelRows(int at, int n) {
+    if (at < 0 || n <= 0 || at + n > E.numRows) return;
+    for (int j = at; j < at + n; ++j) editorFreeRow(&E.row[j]);
+    memmove(&E.row[at], &E.row[at + n], sizeof(erow) * (E.numRows - at - n));
+    E.numRows -= n;
+    lineIndexDelete(at, n);
+    E.dirty++;
+}
+
+void editorRowInsertChar(erow *row, int at, int c) {
+    if (at < 0 || at > row->size) at = row->size;
+    editorRowUnshare(row);
+    row->chars = rowCharsRealloc(row->chars, row->size + 2);
+    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+    row->size++;
+    row->chars[at] = c;
+    editorUpdateRow(row);
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+    editorRowUnshare(row);
+    row->chars = rowCharsRealloc(row->chars, row->size + len + 1);
+    memcpy(&row->chars[row->size], s, len);
+    row->size += len;
+    row->chars[row->size] = '\0';
+    editorUpdateRow(row);
+    E.dirty++;
+}
+
+void editorRowDelChar(erow *row, int at) {
+    if (at < 0 || at >= row->size) return;
+    editorRowUnshare(row);
+    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
+    row->size--;
+    editorUpdateRow(row);
+    E.dirty++;
+}
+
+/*** undo ***/
+
+void editorUndoFree(undoEntry *u) {
+    if (u->rows) {
+        for (int j = 0; j < u->n; ++j)
+            editorFreeRow(&u->rows[j]);
+    }
+    free(u->rows);
+    free(u->idx);
+}
+
+/* saved rows refer to row indices, so any other edit invalidates them */
+void editorUndoClear() {
+    while (E.numUndo > 0)
+        editorUndoFree(&E.undo[--E.numUndo]);
+}
+
+void editorUndoPush(undoEntry *u) {
+    if (E.numUndo == KILO_UNDO_LEVELS) {
+        editorUndoFree(&E.undo[0]);
+        memmove(&E.undo[0], &E.undo[1], sizeof(undoEntry) * (KILO_UNDO_LEVELS - 1));
+        E.numUndo--;
+    }
+    E.undo[E.numUndo++] = *u;
+}
+
+void editorUndo() {
+    if (E.numUndo == 0) {
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+    undoEntry *u = &E.undo[--E.numUndo];
+    int restored = u->n;
+
+    switch (u->kind) {
+        case UNDO_ROWS:
+            /* swap the saved rows back in, then drop the rewritten ones */
+            for (int j = 0; j < u->n; ++j) {
+                erow tmp = E.row[u->idx[j]];
+                E.row[u->idx[j]] = u->rows[j];
+                u->rows[j] = tmp;
+            }
+            if (u->n > 0) {
+                E.cy = u->idx[0];
+                E.cx = 0;
+            }
+            break;
+
+        case UNDO_PERMUTE:
+            {
+                erow *rows = editorMalloc(sizeof(erow) * u->n);
+                for (int j = 0; j < u->n; ++j)
+                    rows[u->idx[j]] = E.row[u->at + j];
+                memcpy(&E.row[u->at], rows, sizeof(erow) * u->n);
+                free(rows);
+                E.cy = u->at;
+                E.cx = 0;
+                break;
+            }
+
+        case UNDO_REMOVE:
+            {
+                /* merge the saved rows back in at their old indices */
+                int total = E.numRows + u->n;
+                erow *rows = editorMalloc(sizeof(erow) * (total ? total : 1));
+                int src = 0, j = 0;
+                for (int i = 0; i < total; ++i) {
+                    if (j < u->n && u->idx[j] == i) rows[i] = u->rows[j++];
+                    else rows[i] = E.row[src++];
+                }
+                free(E.row);
+                E.row = rows;
+                E.numRows = total;
+                if (u->n > 0) {
+                    E.cy = u->idx[0];
+                    E.cx = 0;
+                }
+                u->n = 0; // the rows belong to the buffer again
+                break;
+            }
+    }
+
+    lineIndexInvalidate();
+    editorUndoFree(u);
+    E.dirty++;
+    editorSetStatusMessage("Undo: %d lines restored", restored);
+}
+
+/*** editor operations ***/
+
+void editorInsertChar(int c) {
+    editorUndoClear();
+    if (E.cy == E.numRows) {
+        editorInsertRow(E.numRows, "", 0);
+    }
+    editorRowInsertChar(&E.row[E.cy], E.cx, c);
+    E.cx++;
+}
+
+void editorInsertNewline() {
+    /* handle return key */
+    editorUndoClear();
+    if (E.cx == 0) {
+        editorInsertRow(E.cy, "", 0);
+    }
+    else {
+        erow *row = &E.row[E.cy];
+        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+        /* reassign row ptr because realloc might move memory and invalidate pointer */
+        row = &E.row[E.cy];
+        editorRowUnshare(row);
+        row->size = E.cx;
+        row->chars[row->size] = '\0';
+        editorUpdateRow(row);
+    }
+    E.cy++;
+    E.cx = 0;
+}
+
+void editorDelChar() {
+    if (E.cy == E.numRows) return;
+    if (E.cx == 0 && E.cy == 0) return;
+    editorUndoClear();
+
+    erow *row = &E.row[E.cy];
+    if (E.cx > 0) {
+        editorRowDelChar(row, E.cx - 1);
+        E.cx--;
+    }
+    else {
+        /* append current line to previous line then delete it */
+        E.cx = E.row[E.cy - 1].size;
+        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
+        editorDelRow(E.cy);
+        E.cy--;
+    }
+}
+
+/*** selection ***/
+
+void editorToggleMark() {
+    E.markSet = !E.markSet;
+    E.markX = E.cx;
+    E.markY = E.cy;
+    editorSetStatusMessage(E.markSet ? "Mark set" : "Mark cleared");
+}
+
+/* ordered ends of the selection, clamped to the current buffer */
+int editorRegion(int *y0, int *x0, int *y1, int *x1) {
+    if (!E.markSet) return 0;
+    int my = E.markY > E.numRows ? E.numRows : E.markY;
+    int mx = my < E.numRows ? E.markX : 0;
+    if (my < E.numRows && mx > E.row[my].size) mx = E.row[my].size;
+
+    if (my < E.cy || (my == E.cy && mx < E.cx)) {
+        *y0 = my; *x0 = mx; *y1 = E.cy; *x1 = E.cx;
+    }
+    else {
+        *y0 = E.cy; *x0 = E.cx; *y1 = my; *x1 = mx;
+    }
+    return 1;
+}
+
+/* selected render columns [*hs, *he) of row y, past rsize for its newline */
+int editorRowSelection(int y, int *hs, int *he) {
+    int y0, x0, y1, x1;
+    if (!editorRegion(&y0, &x0, &y1, &x1) || y < y0 || y > y1) return 0;
+    erow *row = &E.row[y];
+    *hs = (y == y0) ? editorRowCxToRx(row, x0) : 0;
+    *he = (y == y1) ? editorRowCxToRx(row, x1) : row->rsize + 1;
+    return *he > *hs;
+}
+
+void clipFree(clip *cb) {
+    for (int j = 0; j < cb->numLines; ++j)
+        rowCharsRelease(cb->lines[j].chars);
+    free(cb->lines);
+}
+
+/* copy a region by reference: rows are shared, not duplicated */
+clip clipFromRegion(int y0, int x0, int y1, int x1) {
+    /* a region running past the last row only takes its newline along */
+    /* when whole rows are selected, see editorDelRegion */
+    if (y1 == E.numRows && y1 > y0 && x0 > 0) {
+        y1--;
+        x1 = E.row[y1].size;
+    }
+    clip cb;
+    cb.numLines = y1 - y0 + 1;
+    cb.lines = editorMalloc(sizeof(clipLine) * cb.numLines);
+    for (int y = y0; y <= y1; ++y) {
+        clipLine *line = &cb.lines[y - y0];
+        line->chars = NULL;
+        line->off = line->len = 0;
+        line->whole = 1;
+        if (y == E.numRows) continue; // region ends after the last newline
+
+        erow *row = &E.row[y];
+        int start = (y == y0) ? x0 : 0;
+        int end = (y == y1) ? x1 : row->size;
+        line->off = start;
+        line->len = end - start;
+        line->whole = (start == 0 && end == row->size);
+        if (line->len > 0) line->chars = rowCharsShare(row->chars);
+    }
+    return cb;
+}
+
+void editorKillPush(clip cb) {
+    if (E.numKill == KILO_KILL_RING) clipFree(&E.kill[--E.numKill]);
+    memmove(&E.kill[1], &E.kill[0], sizeof(clip) * E.numKill);
+    E.kill[0] = cb;
+    E.numKill++;
+}
+
+/* delete from (y0, x0) up to (y1, x1), joining the two ends */
+void editorDelRegion(int y0, int x0, int y1, int x1) {
+    if (y0 >= E.numRows) return;
+    if (y1 == E.numRows) {
+        /* through the end of the buffer, trailing newline included */
+        if (x0 == 0) {
+            editorDelRows(y0, E.numRows - y0);
+            return;
+        }
+        y1 = E.numRows - 1;
+        x1 = E.row[y1].size;
+    }
+
+    erow *first = &E.row[y0], *last = &E.row[y1];
+    int size = x0 + last->size - x1;
+    char *chars = rowCharsAlloc(size + 1);
+    memcpy(chars, first->chars, x0);
+    memcpy(chars + x0, last->chars + x1, last->size - x1);
+    chars[size] = '\0';
+
+    rowCharsRelease(first->chars);
+    first->chars = chars;
+    first->size = size;
+    editorDelRows(y0 + 1, y1 - y0);
+    editorUpdateRow(&E.row[y0]);
+    E.dirty++;
+}
+
+void editorCopy(int cut) {
+    int y0, x0, y1, x1;
+    if (!editorRegion(&y0, &x0, &y1, &x1)) {
+        editorSetStatusMessage("No selection (Ctrl-Space sets the mark)");
+        return;
+    }
+    clip cb = clipFromRegion(y0, x0, y1, x1);
+    editorKillPush(cb);
+    if (cut) {
+        editorUndoClear();
+        editorDelRegion(y0, x0, y1, x1);
+        E.cy = y0;
+        E.cx = x0;
+    }
+    E.markSet = 0;
+    editorSetStatusMessage("%s %d lines", cut ? "Cut" : "Copied", cb.numLines);
+}
+
+void pasteRenderRows(void *arg, int part, int lo, int hi) {
+    (void)part;
+    erow *rows = arg;
+    for (int j = lo; j < hi; ++j) editorRenderRow(&rows[j]);
+}
+
+/* a new, unrendered row holding s1, s2 and s3 back to back */
+erow pasteJoin(const char *s1, int len1, const char *s2, int len2,
+               const char *s3, int len3) {
+    erow row;
+    row.size = len1 + len2 + len3;
+    row.chars = rowCharsAlloc(row.size + 1);
+    if (len1) memcpy(row.chars, s1, len1);
+    if (len2) memcpy(row.chars + len1, s2, len2);
+    if (len3) memcpy(row.chars + len1 + len2, s3, len3);
+    row.chars[row.size] = '\0';
+    row.render = NULL;
+    row.rsize = 0;
+    return row;
+}
+
+/* insert a copied block at the cursor with one bulk row insert */
+void editorPasteClip(clip *cb) {
+    editorUndoClear();
+    int atEnd = E.cy == E.numRows;
+    if (atEnd) editorInsertRow(E.numRows, "", 0);
+
+    erow *row = &E.row[E.cy];
+    clipLine *l0 = &cb->lines[0];
+    clipLine *ln = &cb->lines[cb->numLines - 1];
+    const char *s0 = l0->chars ? l0->chars + l0->off : "";
+    const char *sn = ln->chars ? ln->chars + ln->off : "";
+    E.yankX = E.cx;
+    E.yankY = E.cy;
+
+    if (cb->numLines == 1) {
+        erow full = pasteJoin(row->chars, E.cx, s0, l0->len,
+                              row->chars + E.cx, row->size - E.cx);
+        rowCharsRelease(row->chars);
+        row->chars = full.chars;
+        row->size = full.size;
+        editorUpdateRow(row);
+        E.cx += l0->len;
+        E.dirty++;
+        return;
+    }
+
+    /* middle lines that cover whole rows share their storage */
+    int n = cb->numLines - 1;
+    erow *rows = editorMalloc(sizeof(erow) * n);
+    for (int j = 1; j < n; ++j) {
+        clipLine *line = &cb->lines[j];
+        if (line->whole && line->chars) {
+            rows[j - 1].chars = rowCharsShare(line->chars);
+            rows[j - 1].size = line->len;
+            rows[j - 1].render = NULL;
+            rows[j - 1].rsize = 0;
+        }
+        else {
+            rows[j - 1] = pasteJoin(line->chars ? line->chars + line->off : "",
+                                    line->len, "", 0, "", 0);
+        }
+    }
+    rows[n - 1] = pasteJoin(sn, ln->len, row->chars + E.cx, row->size - E.cx, "", 0);
+    editorParallelFor(n, pasteRenderRows, rows);
+
+    erow first = pasteJoin(row->chars, E.cx, s0, l0->len, "", 0);
+    rowCharsRelease(row->chars);
+    row->chars = first.chars;
+    row->size = first.size;
+    editorUpdateRow(row);
+
+    editorInsertRows(E.cy + 1, rows, n);
+    free(rows);
+    E.cy += n;
+    E.cx = ln->len;
+    /* whole rows pasted past the end don't leave an extra empty one */
+    if (atEnd && ln->len == 0) editorDelRow(E.cy);
+}
+
+void editorPaste() {
+    if (E.numKill == 0) {
+        editorSetStatusMessage("Kill ring is empty");
+        return;
+    }
+    E.yankIdx = 0;
+    editorPasteClip(&E.kill[0]);
+    E.yanked = 1;
+}
+
+/* replace the text just pasted with the previous kill ring entry */
+void editorYankPop() {
+    if (!E.yanked) {
+        editorSetStatusMessage("Previous command was not a paste");
+        return;
+    }
+    editorDelRegion(E.yankY, E.yankX, E.cy, E.cx);
+    E.cy = E.yankY;
+    E.cx = E.yankX;
+    E.yankIdx = (E.yankIdx + 1) % E.numKill;
+    editorPasteClip(&E.kill[E.yankIdx]);
+    editorSetStatusMessage("Kill ring entry %d of %d", E.yankIdx + 1, E.numKill);
+}
+
+/*** multiple cursors ***/
+
+enum multiEditOp {
+    MULTI_INSERT = 0,
+    MULTI_BACKSPACE,
+    MULTI_DELETE
+};
+
+typedef struct {
+    int op;
+    char c; // MULTI_INSERT: the char typed
+    int *groups; // first cursor of each affected row, plus an end marker
+    erow *rows; // rebuilt rows, chars NULL when a row didn't change
+} multiEdit;
+
+int cursorCmp(const void *a, const void *b) {
+    const cursor *x = a, *y = b;
+    if (x->cy != y->cy) return x->cy < y->cy ? -1 : 1;
+    return (x->cx > y->cx) - (x->cx < y->cx);
+}
+
+/* index of the first cursor on row y or below */
+int editorFirstCursor(int y) {
+    int lo = 0, hi = E.numCursors;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (E.cursors[mid].cy < y) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+void editorClearCursors() {
+    free(E.cursors);
+    E.cursors = NULL;
+    E.numCursors = 0;
+    E.primary = 0;
+}
+
+/* drop duplicates from the sorted cursors, keeping track of the primary */
+/* one, and move the regular cursor along with it */
+void editorSyncCursors() {
+    int n = 0;
+    int primary = 0;
+    for (int i = 0; i < E.numCursors; ++i) {
+        cursor *cur = &E.cursors[i];
+        if (n > 0 && E.cursors[n - 1].cy == cur->cy && E.cursors[n - 1].cx == cur->cx) {
+            if (i == E.primary) primary = n - 1;
+            continue;
+        }
+        if (i == E.primary) primary = n;
+        E.cursors[n++] = *cur;
+    }
+    E.numCursors = n;
+    E.primary = primary;
+    E.cx = E.cursors[primary].cx;
+    E.cy = E.cursors[primary].cy;
+    if (n == 1) editorClearCursors();
+}
+
+void editorAddCursor(int cx, int cy, int ax) {
+    E.cursors = editorRealloc(E.cursors, sizeof(cursor) * (E.numCursors + 1));
+    E.cursors[E.numCursors].cx = cx;
+    E.cursors[E.numCursors].cy = cy;
+    E.cursors[E.numCursors].ax = ax;
+    E.cursors[E.numCursors].rx = cy < E.numRows ? editorRowCxToRx(&E.row[cy], cx) : 0;
+    E.numCursors++;
+}
+
+/* the cursor to use when multi-cursor editing starts */
+void editorStartCursors() {
+    if (E.numCursors > 0) return;
+    editorAddCursor(E.cx, E.cy, E.cx);
+    E.primary = 0;
+}
+
+/* add a cursor on the line below the last one, at the primary cursor's */
+/* column so tabs and short lines in between don't shift it */
+void editorAddCursorBelow() {
+    if (E.cy >= E.numRows) return;
+    editorStartCursors();
+    cursor *last = &E.cursors[E.numCursors - 1];
+    if (last->cy + 1 >= E.numRows) {
+        editorSetStatusMessage("No line below");
+        return;
+    }
+    int rx = E.cursors[E.primary].rx;
+    int cx = editorRowRxToCx(&E.row[last->cy + 1], rx);
+    editorAddCursor(cx, last->cy + 1, cx);
+    E.cursors[E.numCursors - 1].rx = rx;
+    editorSetStatusMessage("%d cursors", E.numCursors);
+}
+
+/* turn the rectangle between the mark and the cursor into one cursor per */
+/* row, each selecting that row's part of the rectangle */
+void editorBlockCursors() {
+    if (!E.markSet || E.cy >= E.numRows) {
+        editorSetStatusMessage("No selection (Ctrl-Space sets the mark)");
+        return;
+    }
+    int my = E.markY >= E.numRows ? E.numRows - 1 : E.markY;
+    int mx = E.markX > E.row[my].size ? E.row[my].size : E.markX;
+    int rxMark = editorRowCxToRx(&E.row[my], mx);
+    int rxCursor = editorRowCxToRx(&E.row[E.cy], E.cx);
+    int left = rxMark < rxCursor ? rxMark : rxCursor;
+    int y0 = my < E.cy ? my : E.cy;
+    int y1 = my < E.cy ? E.cy : my;
+
+    editorClearCursors();
+    int primary = -1;
+    for (int y = y0; y <= y1; ++y) {
+        erow *row = &E.row[y];
+        if (row->rsize < left) continue; // too short to reach the block
+        int cx = editorRowRxToCx(row, rxCursor);
+        int ax = editorRowRxToCx(row, rxMark);
+        if (y == E.cy) primary = E.numCursors;
+        editorAddCursor(cx, y, ax);
+    }
+    E.markSet = 0;
+    if (E.numCursors == 0) return;
+    E.primary = primary >= 0 ? primary : 0;
+    editorSyncCursors();
+    editorSetStatusMessage("%d cursors", E.numCursors ? E.numCursors : 1);
+}
+
+/* rebuild the rows of cursor groups [lo, hi) with every cursor's edit */
+void multiEditRows(void *arg, int part, int lo, int hi) {
+    (void)part;
+    multiEdit *me = arg;
+    for (int g = lo; g < hi; ++g) {
+        cursor *first = &E.cursors[me->groups[g]];
+        cursor *end = &E.cursors[me->groups[g + 1]];
+        erow *row = &E.row[first->cy];
+        erow *out = &me->rows[g];
+        out->chars = NULL;
+
+        /* pass 1: the size of the new row */
+        int ins = (me->op == MULTI_INSERT);
+        long size = 0;
+        int prev = 0, changed = 0;
+        for (cursor *cur = first; cur < end; ++cur) {
+            int ds = cur->ax < cur->cx ? cur->ax : cur->cx;
+            int de = cur->ax < cur->cx ? cur->cx : cur->ax;
+            if (ds == de) {
+                if (me->op == MULTI_BACKSPACE && ds > 0) ds--;
+                else if (me->op == MULTI_DELETE && de < row->size) de++;
+            }
+            if (ds < prev) ds = prev;
+            if (de < ds) de = ds;
+            size += (ds - prev) + ins;
+            changed |= (de > ds) || ins;
+            prev = de;
+        }
+        if (!changed) continue;
+        size += row->size - prev;
+
+        /* pass 2: build it and move the cursors */
+        out->size = size;
+        out->chars = rowCharsAlloc(size + 1);
+        out->render = NULL;
+        char *dst = out->chars;
+        prev = 0;
+        for (cursor *cur = first; cur < end; ++cur) {
+            int ds = cur->ax < cur->cx ? cur->ax : cur->cx;
+            int de = cur->ax < cur->cx ? cur->cx : cur->ax;
+            if (ds == de) {
+                if (me->op == MULTI_BACKSPACE && ds > 0) ds--;
+                else if (me->op == MULTI_DELETE && de < row->size) de++;
+            }
+            if (ds < prev) ds = prev;
+            if (de < ds) de = ds;
+            memcpy(dst, row->chars + prev, ds - prev);
+            dst += ds - prev;
+            if (ins) *dst++ = me->c;
+            cur->cx = cur->ax = dst - out->chars;
+            prev = de;
+        }
+        memcpy(dst, row->chars + prev, row->size - prev);
+        out->chars[size] = '\0';
+        editorRenderRow(out);
+        for (cursor *cur = first; cur < end; ++cur)
+            cur->rx = editorRowCxToRx(out, cur->cx);
+    }
+}
+
+/* apply one keystroke at every cursor: each touched row is rebuilt and */
+/* rendered once, however many cursors it has */
+void editorMultiEdit(int op, int c) {
+    editorUndoClear();
+    multiEdit me;
+    me.op = op;
+    me.c = c;
+    me.groups = editorMalloc(sizeof(int) * (E.numCursors + 1));
+    int numGroups = 0;
+    for (int i = 0; i < E.numCursors; ++i) {
+        if (E.cursors[i].cy >= E.numRows) break;
+        if (i == 0 || E.cursors[i].cy != E.cursors[i - 1].cy)
+            me.groups[numGroups++] = i;
+    }
+    me.groups[numGroups] = numGroups ? editorFirstCursor(E.numRows) : 0;
+    me.rows = editorMalloc(sizeof(erow) * (numGroups ? numGroups : 1));
+
+    editorParallelFor(numGroups, multiEditRows, &me);
+
+    for (int g = 0; g < numGroups; ++g) {
+        if (!me.rows[g].chars) continue;
+        int y = E.cursors[me.groups[g]].cy;
+        editorFreeRow(&E.row[y]);
+        E.row[y] = me.rows[g];
+        lineIndexUpdate(y);
+    }
+    free(me.groups);
+    free(me.rows);
+    E.dirty++;
+    editorSyncCursors();
+}
+
+void editorMultiMove(int key) {
+    for (int i = 0; i < E.numCursors; ++i) {
+        cursor *cur = &E.cursors[i];
+        if (key == ARROW_UP || key == ARROW_DOWN) {
+            /* keep aiming for the same render column across lines */
+            if (key == ARROW_UP && cur->cy > 0) cur->cy--;
+            if (key == ARROW_DOWN && cur->cy + 1 < E.numRows) cur->cy++;
+            cur->cx = cur->ax = editorRowRxToCx(&E.row[cur->cy], cur->rx);
+            continue;
+        }
+        int size = cur->cy < E.numRows ? E.row[cur->cy].size : 0;
+        if (key == ARROW_LEFT && cur->cx > 0) cur->cx--;
+        if (key == ARROW_RIGHT && cur->cx < size) cur->cx++;
+        if (key == HOME_KEY) cur->cx = 0;
+        if (key == END_KEY || cur->cx > size) cur->cx = size;
+        cur->ax = cur->cx;
+        cur->rx = cur->cy < E.numRows ? editorRowCxToRx(&E.row[cur->cy], cur->cx) : 0;
+    }
+    if (key == ARROW_UP || key == ARROW_DOWN) {
+        /* cursors stopped by the first or last line can fall out of order */
+        cursor primary = E.cursors[E.primary];
+        qsort(E.cursors, E.numCursors, sizeof(cursor), cursorCmp);
+        E.primary = editorFirstCursor(primary.cy);
+        while (E.cursors[E.primary].cx != primary.cx) E.primary++;
+    }
+    editorSyncCursors();
+}
+
+/* handle a key while several cursors are active, 0 if it ends that mode */
+int editorMultiCursorKey(int c) {
+    switch (c) {
+        case BACKSPACE:
+        case CTRL_KEY('h'):
+            editorMultiEdit(MULTI_BACKSPACE, 0);
+            return 1;
+        case DEL_KEY:
+            editorMultiEdit(MULTI_DELETE, 0);
+            return 1;
+        case ARROW_UP:
+        case ARROW_DOWN:
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+        case HOME_KEY:
+        case END_KEY:
+            editorMultiMove(c);
+            return 1;
+        case CTRL_KEY('d'):
+            editorAddCursorBelow();
+            return 1;
+        case '\x1b':
+            editorClearCursors();
+            return 1;
+    }
+    /* plain text, tabs and bytes of multibyte characters */
+    if (c == '\t' || (c >= ' ' && c < BACKSPACE) || c < 0) {
+        editorMultiEdit(MULTI_INSERT, c);
+        return 1;
+    }
+    editorClearCursors();
+    return 0;
+}
+
+/*** line commands ***/
+
+/* fast non-cryptographic hash of a line, eight bytes at a time */
+uint64_t editorHash(const char *s, size_t len) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+    uint64_t k;
+    while (len >= 8) {
+        memcpy(&k, s, 8);
+        h = (h ^ k) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+        s += 8;
+        len -= 8;
+    }
+    k = 0;
+    memcpy(&k, s, len);
+    h = (h ^ k) * 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 29);
+}
+
+typedef struct {
+    erow *base; // first row of the range
+    int *perm; // row indices relative to base
+    int *tmp; // merge buffer
+    int *runs; // sorted runs: [runs[i], runs[i + 1])
+    int reverse;
+    const char *pattern; // keep/drop regex, see editorRegexCheck
+    char *keep; // per row: 1 to keep it
+    uint64_t *hashes;
+} lineJob;
+
+int lineCmp(lineJob *job, int a, int b) {
+    erow *x = &job->base[a], *y = &job->base[b];
+    int n = x->size < y->size ? x->size : y->size;
+    int c = memcmp(x->chars, y->chars, n);
+    if (c == 0) c = (x->size > y->size) - (x->size < y->size);
+    if (job->reverse) c = -c;
+    /* equal lines keep their order, so the sort is stable */
+    return c ? c : (a > b) - (a < b);
+}
+
+int lineQsortCmp(const void *a, const void *b, void *job) {
+    return lineCmp(job, *(const int *)a, *(const int *)b);
+}
+
+void lineSortRun(void *arg, int part, int lo, int hi) {
+    (void)lo;
+    (void)hi;
+    lineJob *job = arg;
+    int *p = &job->perm[job->runs[part]];
+    qsort_r(p, job->runs[part + 1] - job->runs[part], sizeof(int), lineQsortCmp, job);
+}
+
+/* merge run pair `part` of the current pass from perm into tmp */
+void lineMergeRuns(void *arg, int part, int lo, int hi) {
+    (void)lo;
+    (void)hi;
+    lineJob *job = arg;
+    int a = job->runs[2 * part], m = job->runs[2 * part + 1], b = job->runs[2 * part + 2];
+    int i = a, j = m, k = a;
+    while (i < m && j < b)
+        job->tmp[k++] = lineCmp(job, job->perm[i], job->perm[j]) <= 0 ? job->perm[i++] : job->perm[j++];
+    while (i < m) job->tmp[k++] = job->perm[i++];
+    while (j < b) job->tmp[k++] = job->perm[j++];
+}
+
+/* sort rows [at, at + n) by reordering row references, never line bytes */
+void editorSortLines(int at, int n, int reverse) {
+    lineJob job;
+    job.base = &E.row[at];
+    job.reverse = reverse;
+    job.perm = editorMalloc(sizeof(int) * n);
+    job.tmp = editorMalloc(sizeof(int) * n);
+    for (int i = 0; i < n; ++i) job.perm[i] = i;
+
+    /* sort one run per thread, then merge pairs of runs in parallel */
+    int parts = editorParallelParts(n);
+    int runs[KILO_MAX_THREADS + 1];
+    for (int i = 0; i <= parts; ++i) runs[i] = (long)n * i / parts;
+    job.runs = runs;
+    editorParallelSplit(n, parts, lineSortRun, &job);
+
+    while (parts > 1) {
+        int pairs = parts / 2;
+        editorParallelSplit(pairs, pairs, lineMergeRuns, &job);
+        /* an odd run out is carried over as is */
+        if (parts % 2)
+            memcpy(&job.tmp[runs[parts - 1]], &job.perm[runs[parts - 1]],
+                   sizeof(int) * (runs[parts] - runs[parts - 1]));
+        int *swap = job.perm;
+        job.perm = job.tmp;
+        job.tmp = swap;
+        int merged = 0;
+        for (int i = 0; i <= parts; i += 2) runs[merged++] = runs[i];
+        if (parts % 2) runs[merged++] = runs[parts];
+        parts = merged - 1;
+    }
+
+    /* apply the permutation and keep it for undo */
+    erow *rows = editorMalloc(sizeof(erow) * (n ? n : 1));
+    for (int i = 0; i < n; ++i) rows[i] = job.base[job.perm[i]];
+    memcpy(job.base, rows, sizeof(erow) * n);
+    free(rows);
+    free(job.tmp);
+
+    undoEntry u;
+    u.kind = UNDO_PERMUTE;
+    u.n = n;
+    u.at = at;
+    u.idx = job.perm;
+    u.rows = NULL;
+    editorUndoPush(&u);
+    lineIndexInvalidate();
+    E.dirty++;
+    editorSetStatusMessage("Sorted %d lines (Ctrl-Z to undo)", n);
+}
+
+/* drop the rows of [at, at + n) whose keep flag is 0, saving them for undo */
+void editorRemoveLines(int at, int n, const char *keep, const char *what) {
+    int removed = 0;
+    for (int i = 0; i < n; ++i) removed += !keep[i];
+    if (removed == 0) {
+        editorSetStatusMessage("%s: no lines removed", what);
+        return;
+    }
+
+    undoEntry u;
+    u.kind = UNDO_REMOVE;
+    u.n = removed;
+    u.at = at;
+    u.idx = editorMalloc(sizeof(int) * removed);
+    u.rows = editorMalloc(sizeof(erow) * removed);
+    int dst = at, j = 0;
+    for (int i = 0; i < n; ++i) {
+        if (keep[i]) {
+            E.row[dst++] = E.row[at + i];
+        }
+        else {
+            u.idx[j] = at + i;
+            u.rows[j++] = E.row[at + i];
+        }
+    }
+    memmove(&E.row[dst], &E.row[at + n], sizeof(erow) * (E.numRows - at - n));
+    E.numRows -= removed;
+
+    editorUndoPush(&u);
+    lineIndexInvalidate();
+    E.dirty++;
+    editorSetStatusMessage("%s: removed %d of %d lines (Ctrl-Z to undo)", what, removed, n);
+}
+
+void lineHashRows(void *arg, int part, int lo, int hi) {
+    (void)part;
+    lineJob *job = arg;
+    for (int i = lo; i < hi; ++i)
+        job->hashes[i] = editorHash(job->base[i].chars, job->base[i].size);
+}
+
+/* keep the first occurrence of every distinct line */
+void editorUniqLines(int at, int n) {
+    lineJob job;
+    job.base = &E.row[at];
+    job.hashes = editorMalloc(sizeof(uint64_t) * (n ? n : 1));
+    job.keep = editorMalloc(n ? n : 1);
+    editorParallelFor(n, lineHashRows, &job);
+
+    /* open addressing table of row index + 1, at most half full */
+    size_t cap = 16;
+    while (cap < (size_t)n * 2) cap *= 2;
+    int *table = editorCalloc(cap, sizeof(int));
+    for (int i = 0; i < n; ++i) {
+        erow *row = &job.base[i];
+        size_t slot = job.hashes[i] & (cap - 1);
+        job.keep[i] = 1;
+        while (table[slot]) {
+            int other = table[slot] - 1;
+            if (job.hashes[other] == job.hashes[i] && job.base[other].size == row->size &&
+                    memcmp(job.base[other].chars, row->chars, row->size) == 0) {
+                job.keep[i] = 0;
+                break;
+            }
+            slot = (slot + 1) & (cap - 1);
+        }
+        if (job.keep[i]) table[slot] = i + 1;
+    }
+    free(table);
+    free(job.hashes);
+
+    editorRemoveLines(at, n, job.keep, "uniq");
+    free(job.keep);
+}
+
+void lineMatchRows(void *arg, int part, int lo, int hi) {
+    (void)part;
+    lineJob *job = arg;
+    regex_t re;
+    editorRegexWorker(&re, job->pattern, REG_EXTENDED | REG_NOSUB);
+    for (int i = lo; i < hi; ++i)
+        job->keep[i] = (regexec(&re, job->base[i].chars, 0, NULL, 0) == 0) != job->reverse;
+    regfree(&re);
+}
+
+/* keep (or with drop set, remove) the lines matching pattern */
+void editorFilterLines(int at, int n, const char *pattern, int drop) {
+    lineJob job;
+    job.base = &E.row[at];
+    job.reverse = drop;
+    job.pattern = pattern;
+    if (editorRegexCheck(pattern, REG_EXTENDED | REG_NOSUB) < 0) return;
+    job.keep = editorMalloc(n ? n : 1);
+    editorParallelFor(n, lineMatchRows, &job);
+
+    editorRemoveLines(at, n, job.keep, drop ? "drop" : "keep");
+    free(job.keep);
+}
+
+/* run a line command on the selected lines, or on the whole buffer */
+void editorLineCommand() {
+    char *cmd = editorPrompt("Lines: %s (sort, sort -r, uniq, keep RE, drop RE)", NULL);
+    if (cmd == NULL) return;
+
+    int at = 0, n = E.numRows;
+    int y0, x0, y1, x1;
+    if (editorRegion(&y0, &x0, &y1, &x1)) {
+        /* a selection ending at the start of a line doesn't include it */
+        if (y1 > y0 && x1 == 0) y1--;
+        if (y1 >= E.numRows) y1 = E.numRows - 1;
+        at = y0;
+        n = y1 - y0 + 1;
+        E.markSet = 0;
+    }
+
+    if (n <= 0) {
+        editorSetStatusMessage("No lines");
+    }
+    else if (!strcmp(cmd, "sort") || !strcmp(cmd, "sort -r")) {
+        editorSortLines(at, n, cmd[4] != '\0');
+        E.cy = at;
+        E.cx = 0;
+    }
+    else if (!strcmp(cmd, "uniq")) {
+        editorUniqLines(at, n);
+    }
+    else if (!strncmp(cmd, "keep ", 5) || !strncmp(cmd, "drop ", 5)) {
+        editorFilterLines(at, n, cmd + 5, cmd[0] == 'd');
+    }
+    else {
+        editorSetStatusMessage("Unknown line command: %s", cmd);
+    }
+    free(cmd);
+
+    if (E.cy > E.numRows) E.cy = E.numRows;
+    if (E.cy < E.numRows && E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+}
+
+/*** macros ***/
+
+void editorMacroToggle() {
+    keyMacro *m = &E.macro;
+    if (m->playing) return;
+    if (!m->recording) {
+        m->len = 0;
+        m->recording = 1;
+        editorSetStatusMessage("Recording macro, Ctrl-O to stop");
+        return;
+    }
+    m->recording = 0;
+    m->len--; // the Ctrl-O that stopped the recording
+    editorSetStatusMessage("Macro recorded: %d keys (Ctrl-E to run)", m->len);
+}
+
+/* replay the macro once against the current state */
+void editorMacroPlay() {
+    keyMacro *m = &E.macro;
+    m->playing = 1;
+    m->pos = 0;
+    while (m->pos < m->len) editorProcessKeypress();
+    m->playing = 0;
+}
+
+void editorMacroRun() {
+    keyMacro *m = &E.macro;
+    if (m->playing) return;
+    if (m->recording) {
+        m->len--; // this Ctrl-E
+        editorSetStatusMessage("Stop recording (Ctrl-O) before running the macro");
+        return;
+    }
+    if (m->len == 0) {
+        editorSetStatusMessage("No macro recorded (Ctrl-O to record)");
+        return;
+    }
+
+    char *arg = editorPrompt("Run macro: %s (N times, or A,B for each line A..B)", NULL);
+    if (arg == NULL) return;
+    long times = 0, from = 0, to = 0;
+    int perLine = (sscanf(arg, "%ld,%ld", &from, &to) == 2);
+    if (!perLine) times = strtol(arg, NULL, 10);
+    free(arg);
+    if ((perLine && (from < 1 || to < from)) || (!perLine && times < 1)) {
+        editorSetStatusMessage("Invalid macro count or line range");
+        return;
+    }
 
-    int idx = 0;
-    for (j = 0; j < row->size; ++j) {
-        if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-            while (idx % 8 != 0) row->render[idx++] = ' ';
-        }
-        else {
-            row->render[idx++] = row->chars[j];
+    /* nothing is drawn until the whole run is done */
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    E.batch = 1;
+    long runs = 0;
+    if (perLine) {
+        /* follow lines the macro inserts or deletes on its way */
+        for (long line = from; line <= to && line <= E.numRows; ++line, ++runs) {
+            int before = E.numRows;
+            E.cy = line - 1;
+            E.cx = 0;
+            editorMacroPlay();
+            line += E.numRows - before;
+            to += E.numRows - before;
         }
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
-}
+    else {
+        for (; runs < times; ++runs) editorMacroPlay();
+    }
+    E.batch = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
 
-void editorInsertRow(int at, char *s, size_t len) {
-    if (at < 0 || at > E.numRows) return;
+    if (E.cy > E.numRows) E.cy = E.numRows;
+    if (E.cy < E.numRows && E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+    editorSetStatusMessage("Macro ran %ld times in %.2fs", runs,
+            (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+}
 
-    E.row = realloc(E.row, sizeof(erow) * (E.numRows + 1));
-    memmove(&E.row[at+1], &E.row[at], sizeof(erow) * (E.numRows - at));
+/*** external changes ***/
 
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+/* remember the file's mtime and size as of the last open, save or reload */
+void editorRecordFileStat() {
+    struct stat st;
+    E.fileStatValid = E.filename && stat(E.filename, &st) == 0;
+    if (E.fileStatValid) {
+        E.fileMtime = st.st_mtim;
+        E.fileSize = st.st_size;
+    }
+    E.fileChanged = 0;
+}
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    editorUpdateRow(&E.row[at]);
+int editorFileChangedOnDisk() {
+    if (!E.fileStatValid) return 0;
+    struct stat st;
+    if (stat(E.filename, &st) == -1) return 1;
+    return st.st_size != E.fileSize ||
+           st.st_mtim.tv_sec != E.fileMtime.tv_sec ||
+           st.st_mtim.tv_nsec != E.fileMtime.tv_nsec;
+}
 
-    E.numRows++;
-    E.dirty++;
+/* the file as read back from disk, split into hashed lines */
+typedef struct {
+    char *buf;
+    long *start;
+    int *len;
+    uint64_t *hash;
+    int n;
+    int *match; // per line: the old row with the same contents, or -1
+    erow *rows; // the new row array being built
+    int at; // first line of the changed span
+} reloadJob;
+
+void reloadHashLines(void *arg, int part, int lo, int hi) {
+    (void)part;
+    reloadJob *rj = arg;
+    for (int j = lo; j < hi; ++j)
+        rj->hash[j] = editorHash(rj->buf + rj->start[j], rj->len[j]);
 }
 
-void editorFreeRow(erow *row) {
-    free(row->render);
-    free(row->chars);
+/* build the rows of lines that didn't match an old row */
+void reloadBuildRows(void *arg, int part, int lo, int hi) {
+    (void)part;
+    reloadJob *rj = arg;
+    for (int j = lo; j < hi; ++j) {
+        if (rj->match[j] >= 0) continue;
+        int line = rj->at + j;
+        erow *row = &rj->rows[line];
+        row->size = rj->len[line];
+        row->chars = rowCharsAlloc(row->size + 1);
+        memcpy(row->chars, rj->buf + rj->start[line], row->size);
+        row->chars[row->size] = '\0';
+        row->rsize = 0;
+        row->render = NULL;
+        editorRenderRow(row);
+    }
 }
 
-void editorDelRow(int at) {
-    if (at < 0 || at >= E.numRows) return;
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numRows - at - 1));
-    E.numRows--;
-    E.dirty++;
+/* read the whole file in one go and split it like editorOpen does */
+int reloadRead(reloadJob *rj) {
+    int fd = open(E.filename, O_RDONLY);
+    if (fd == -1) return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    rj->buf = editorMalloc(st.st_size + 1);
+    long got = 0;
+    ssize_t n = 0;
+    while (got < st.st_size && (n = read(fd, rj->buf + got, st.st_size - got)) > 0)
+        got += n;
+    close(fd);
+    /* never reload a partial read, a save would then truncate the file */
+    if (got != st.st_size) {
+        if (n == 0) errno = EAGAIN; // the file shrank while being read
+        free(rj->buf);
+        return -1;
+    }
+
+    int cap = 1024;
+    rj->n = 0;
+    rj->start = editorMalloc(sizeof(long) * cap);
+    rj->len = editorMalloc(sizeof(int) * cap);
+    for (long pos = 0; pos < got;) {
+        char *nl = memchr(rj->buf + pos, '\n', got - pos);
+        long end = nl ? nl - rj->buf : got;
+        long len = end - pos;
+        while (len > 0 && rj->buf[pos + len - 1] == '\r') --len;
+        if (rj->n == cap) {
+            cap *= 2;
+            rj->start = editorRealloc(rj->start, sizeof(long) * cap);
+            rj->len = editorRealloc(rj->len, sizeof(int) * cap);
+        }
+        rj->start[rj->n] = pos;
+        rj->len[rj->n++] = len;
+        pos = end + 1;
+    }
+    rj->hash = editorMalloc(sizeof(uint64_t) * (rj->n ? rj->n : 1));
+    editorParallelFor(rj->n, reloadHashLines, rj);
+    return 0;
 }
 
-void editorRowInsertChar(erow *row, int at, int c) {
-    if (at < 0 || at > row->size) at = row->size;
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    editorUpdateRow(row);
+/* old row at + i and new line at + j, by hash and length */
+int reloadSame(reloadJob *rj, uint64_t *oldHash, int i, int j) {
+    erow *row = &E.row[rj->at + i];
+    j += rj->at;
+    /* a hash collision must not keep a stale row in a clean buffer */
+    return oldHash[rj->at + i] == rj->hash[j] && row->size == rj->len[j] &&
+           memcmp(row->chars, rj->buf + rj->start[j], row->size) == 0;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.dirty++;
+/* Myers' O(ND) diff of old rows [o0, o0 + n) against new lines [j0, j0 + m) */
+/* of the changed span; fills match and returns -1 if it would take more */
+/* than KILO_RELOAD_MAX_EDITS edits or more than linear work */
+int reloadMyers(reloadJob *rj, uint64_t *oldHash, int o0, int n, int j0, int m) {
+    int maxD = n + m < KILO_RELOAD_MAX_EDITS ? n + m : KILO_RELOAD_MAX_EDITS;
+    int off = maxD + 1;
+    int *v = editorMalloc(sizeof(int) * (2 * maxD + 3));
+    int *trace = NULL; // v[-d..d] after each step d, at offset d * d
+    long traceLen = 0, traceCap = 0;
+    /* repetitive lines make long snakes on many diagonals, cap the work */
+    long work = 0, budget = 16L * (n + m) + 4096;
+    int found = -1;
+
+    v[off + 1] = 0;
+    for (int d = 0; d <= maxD && found < 0 && work <= budget; ++d) {
+        for (int k = -d; k <= d; k += 2) {
+            int x = (k == -d || (k != d && v[off + k - 1] < v[off + k + 1]))
+                    ? v[off + k + 1] : v[off + k - 1] + 1;
+            int y = x - k;
+            ++work;
+            while (x < n && y < m && reloadSame(rj, oldHash, o0 + x, j0 + y)) {
+                ++x;
+                ++y;
+                ++work;
+            }
+            v[off + k] = x;
+            if (x >= n && y >= m) {
+                found = d;
+                break;
+            }
+        }
+        if (traceLen + 2 * d + 1 > traceCap) {
+            traceCap = traceCap ? traceCap * 2 : 1024;
+            if (traceCap < traceLen + 2 * d + 1) traceCap = traceLen + 2 * d + 1;
+            trace = editorRealloc(trace, sizeof(int) * traceCap);
+        }
+        memcpy(&trace[traceLen], &v[off - d], sizeof(int) * (2 * d + 1));
+        traceLen += 2 * d + 1;
+    }
+    free(v);
+
+    if (found >= 0) {
+        /* walk back along the snakes, they are the lines that stayed */
+        int x = n, y = m;
+        for (int d = found; d > 0; --d) {
+            int *pv = &trace[(long)(d - 1) * (d - 1) + (d - 1)];
+            int k = x - y;
+            int prevK = (k == -d || (k != d && pv[k - 1] < pv[k + 1])) ? k + 1 : k - 1;
+            int prevX = pv[prevK];
+            int sx = (prevK == k + 1) ? prevX : prevX + 1;
+            while (x > sx) {
+                --x;
+                --y;
+                rj->match[j0 + y] = o0 + x;
+            }
+            x = prevX;
+            y = prevX - prevK;
+        }
+        while (x > 0 && y > 0) {
+            --x;
+            --y;
+            rj->match[j0 + y] = o0 + x;
+        }
+    }
+    free(trace);
+    return found;
 }
 
-void editorRowDelChar(erow *row, int at) {
-    if (at < 0 || at >= row->size) return;
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editorUpdateRow(row);
-    E.dirty++;
+typedef struct {
+    uint64_t hash;
+    int oldAt, newAt; // -1 while not seen, -2 once seen twice
+} reloadSlot;
+
+/* the lines that occur exactly once on both sides, as a longest chain */
+/* in increasing order on both sides (the anchors of a patience diff); */
+/* stores old and new indices in *ao and *aj and returns their number */
+int reloadAnchors(reloadJob *rj, uint64_t *oldHash, int o0, int o1, int j0, int j1,
+                  int **ao, int **aj) {
+    int cap = 1;
+    while (cap < 2 * (o1 - o0)) cap *= 2;
+    reloadSlot *tab = editorMalloc(sizeof(reloadSlot) * cap);
+    for (int i = 0; i < cap; ++i) tab[i].oldAt = tab[i].newAt = -1;
+
+    for (int i = o0; i < o1; ++i) {
+        uint64_t h = oldHash[rj->at + i];
+        int s = h & (cap - 1);
+        while (tab[s].oldAt != -1 && tab[s].hash != h) s = (s + 1) & (cap - 1);
+        tab[s].hash = h;
+        tab[s].oldAt = tab[s].oldAt == -1 ? i : -2;
+    }
+    for (int j = j0; j < j1; ++j) {
+        uint64_t h = rj->hash[rj->at + j];
+        int s = h & (cap - 1);
+        while (tab[s].oldAt != -1 && tab[s].hash != h) s = (s + 1) & (cap - 1);
+        if (tab[s].oldAt != -1) tab[s].newAt = tab[s].newAt == -1 ? j : -2;
+    }
+
+    /* longest increasing run of old indices, patience sorting style */
+    int *candO = editorMalloc(sizeof(int) * (j1 - j0));
+    int *candJ = editorMalloc(sizeof(int) * (j1 - j0));
+    int *prev = editorMalloc(sizeof(int) * (j1 - j0));
+    int *tails = editorMalloc(sizeof(int) * (j1 - j0));
+    int numCand = 0, numTails = 0;
+    for (int j = j0; j < j1; ++j) {
+        uint64_t h = rj->hash[rj->at + j];
+        int s = h & (cap - 1);
+        while (tab[s].oldAt != -1 && tab[s].hash != h) s = (s + 1) & (cap - 1);
+        if (tab[s].newAt != j || tab[s].oldAt < 0) continue;
+        if (!reloadSame(rj, oldHash, tab[s].oldAt, j)) continue;
+        int c = numCand++;
+        candO[c] = tab[s].oldAt;
+        candJ[c] = j;
+        int lo = 0, hi = numTails;
+        while (lo < hi) {
+            int mid = lo + (hi - lo) / 2;
+            if (candO[tails[mid]] < candO[c]) lo = mid + 1;
+            else hi = mid;
+        }
+        prev[c] = lo > 0 ? tails[lo - 1] : -1;
+        tails[lo] = c;
+        if (lo == numTails) numTails++;
+    }
+    free(tab);
+
+    *ao = editorMalloc(sizeof(int) * (numTails ? numTails : 1));
+    *aj = editorMalloc(sizeof(int) * (numTails ? numTails : 1));
+    int c = numTails ? tails[numTails - 1] : -1;
+    for (int k = numTails - 1; k >= 0; --k, c = prev[c]) {
+        (*ao)[k] = candO[c];
+        (*aj)[k] = candJ[c];
+    }
+    free(candO);
+    free(candJ);
+    free(prev);
+    free(tails);
+    return numTails;
 }
 
-/*** editor operations ***/
+void reloadDiff(reloadJob *rj, uint64_t *oldHash, int o0, int o1, int j0, int j1,
+                int depth);
+
+/* split old rows [o0, o1) and new lines [j0, j1) on unique lines and diff */
+/* the pieces in between; with nothing unique, keep lines left in place */
+void reloadSplit(reloadJob *rj, uint64_t *oldHash, int o0, int o1, int j0, int j1,
+                 int depth) {
+    int *ao = NULL, *aj = NULL;
+    int k = depth < 8 ? reloadAnchors(rj, oldHash, o0, o1, j0, j1, &ao, &aj) : 0;
+    if (k == 0) {
+        for (int t = 0; o0 + t < o1 && j0 + t < j1; ++t)
+            if (reloadSame(rj, oldHash, o0 + t, j0 + t)) rj->match[j0 + t] = o0 + t;
+        free(ao);
+        free(aj);
+        return;
+    }
+    for (int a = 0; a <= k; ++a) {
+        int oEnd = a < k ? ao[a] : o1;
+        int jEnd = a < k ? aj[a] : j1;
+        reloadDiff(rj, oldHash, o0, oEnd, j0, jEnd, depth + 1);
+        if (a < k) {
+            rj->match[aj[a]] = ao[a];
+            o0 = ao[a] + 1;
+            j0 = aj[a] + 1;
+        }
+    }
+    free(ao);
+    free(aj);
+}
 
-void editorInsertChar(int c) {
-    if (E.cy == E.numRows) {
-        editorInsertRow(E.numRows, "", 0);
+/* match old rows [o0, o1) against new lines [j0, j1) of the changed span. */
+/* Myers finds the fewest edits when there are few; past that, walk both */
+/* sides and after each difference resync on the nearest two lines that */
+/* match again, so scattered edits still cost one linear pass */
+void reloadDiff(reloadJob *rj, uint64_t *oldHash, int o0, int o1, int j0, int j1,
+                int depth) {
+    while (o0 < o1 && j0 < j1 && reloadSame(rj, oldHash, o0, j0))
+        rj->match[j0++] = o0++;
+    while (o0 < o1 && j0 < j1 && reloadSame(rj, oldHash, o1 - 1, j1 - 1))
+        rj->match[--j1] = --o1;
+    if (o0 == o1 || j0 == j1) return;
+    if (reloadMyers(rj, oldHash, o0, o1 - o0, j0, j1 - j0) >= 0) return;
+
+    const int window = 32;
+    while (o0 < o1 && j0 < j1) {
+        if (reloadSame(rj, oldHash, o0, j0)) {
+            rj->match[j0++] = o0++;
+            continue;
+        }
+        /* nearest first, and changed lines before inserted or deleted */
+        /* ones so runs of identical lines don't drift out of step */
+        int found = 0;
+        for (int c = 1; c <= window && !found; ++c) {
+            for (int t = 0; t <= 2 * c && !found; ++t) {
+                int i = o0 + (t % 2 ? c : c - (t + 1) / 2);
+                int j = j0 + (t % 2 ? c - (t + 1) / 2 : c);
+                if (i >= o1 || j >= j1 || !reloadSame(rj, oldHash, i, j)) continue;
+                if (i + 1 < o1 && j + 1 < j1 && !reloadSame(rj, oldHash, i + 1, j + 1))
+                    continue;
+                o0 = i;
+                j0 = j;
+                found = 1;
+            }
+        }
+        if (!found) {
+            /* a long changed stretch, look further ahead for anchors */
+            reloadSplit(rj, oldHash, o0, o1, j0, j1, depth);
+            return;
+        }
     }
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx++;
 }
 
-void editorInsertNewline() {
-    /* handle return key */
-    if (E.cx == 0) {
-        editorInsertRow(E.cy, "", 0);
+/* new index of old row y after a reload: a removed row maps to the next */
+/* row that was kept, or to the same line of the changed span */
+int reloadMapRow(int y, int at, int n, int m, int *oldToNew) {
+    if (y < at) return y;
+    if (y >= at + n) return y - n + m;
+    for (int i = y - at; i < n; ++i)
+        if (oldToNew[i] >= 0) return at + oldToNew[i];
+    return at + (y - at < m ? y - at : m);
+}
+
+/* re-read the file and replace only the rows that differ */
+void editorReload() {
+    reloadJob rj;
+    memset(&rj, 0, sizeof(rj));
+    if (reloadRead(&rj) == -1) {
+        E.fileChanged = 1;
+        editorSetStatusMessage("Can't reload %s: %s", E.filename, strerror(errno));
+        return;
     }
-    else {
-        erow *row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        /* reassign row ptr because realloc might move memory and invalidate pointer */
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+
+    lineJob hj;
+    hj.base = E.row;
+    hj.hashes = editorMalloc(sizeof(uint64_t) * (E.numRows ? E.numRows : 1));
+    editorParallelFor(E.numRows, lineHashRows, &hj);
+    uint64_t *oldHash = hj.hashes;
+
+    /* unchanged head and tail, then a diff of what is left in between */
+    int head = 0;
+    while (head < E.numRows && head < rj.n && reloadSame(&rj, oldHash, head, head))
+        ++head;
+    int tail = 0;
+    while (tail < E.numRows - head && tail < rj.n - head &&
+            reloadSame(&rj, oldHash, E.numRows - 1 - tail, rj.n - 1 - tail)) ++tail;
+    int n = E.numRows - head - tail;
+    int m = rj.n - head - tail;
+
+    rj.at = head;
+    rj.match = editorMalloc(sizeof(int) * (m ? m : 1));
+    for (int j = 0; j < m; ++j) rj.match[j] = -1;
+    reloadDiff(&rj, oldHash, 0, n, 0, m, 0);
+    free(oldHash);
+
+    /* move kept rows over, build new ones, free the rest */
+    int *oldToNew = editorMalloc(sizeof(int) * (n ? n : 1));
+    for (int i = 0; i < n; ++i) oldToNew[i] = -1;
+    int kept = 0;
+    rj.rows = editorMalloc(sizeof(erow) * (rj.n ? rj.n : 1));
+    if (head) memcpy(rj.rows, E.row, sizeof(erow) * head);
+    if (tail) memcpy(&rj.rows[head + m], &E.row[head + n], sizeof(erow) * tail);
+    for (int j = 0; j < m; ++j) {
+        if (rj.match[j] < 0) continue;
+        rj.rows[head + j] = E.row[head + rj.match[j]];
+        oldToNew[rj.match[j]] = j;
+        ++kept;
     }
-    E.cy++;
-    E.cx = 0;
+    editorParallelFor(m, reloadBuildRows, &rj);
+    for (int i = 0; i < n; ++i)
+        if (oldToNew[i] < 0) editorFreeRow(&E.row[head + i]);
+
+    E.cy = reloadMapRow(E.cy, head, n, m, oldToNew);
+    E.rowOff = reloadMapRow(E.rowOff, head, n, m, oldToNew);
+    free(E.row);
+    E.row = rj.rows;
+    E.numRows = rj.n;
+    if (E.cy > E.numRows) E.cy = E.numRows;
+    if (E.cy < E.numRows && E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+
+    free(oldToNew);
+    free(rj.match);
+    free(rj.buf);
+    free(rj.start);
+    free(rj.len);
+    free(rj.hash);
+
+    lineIndexInvalidate();
+    editorUndoClear();
+    editorClearCursors();
+    E.markSet = 0;
+    E.yanked = 0;
+    E.dirty = 0;
+    editorRecordFileStat();
+    editorSetStatusMessage("Reloaded from disk: %d lines removed, %d added",
+            n - kept, m - kept);
 }
 
-void editorDelChar() {
-    if (E.cy == E.numRows) return;
-    if (E.cx == 0 && E.cy == 0) return;
+/* reload an unmodified buffer, warn about a modified one; 1 if either */
+int editorCheckFile() {
+    E.lastCheck = time(NULL);
+    if (E.fileChanged || !editorFileChangedOnDisk()) return 0;
+    if (E.dirty) {
+        E.fileChanged = 1;
+        editorSetStatusMessage("File changed on disk! Ctrl-U reloads it, "
+                "Ctrl-S asks before overwriting");
+        return 1;
+    }
+    editorReload();
+    return 1;
+}
 
-    erow *row = &E.row[E.cy];
-    if (E.cx > 0) {
-        editorRowDelChar(row, E.cx - 1);
-        E.cx--;
+void editorCheckFileTimer() {
+    if (E.prompting || E.batch || !E.fileStatValid) return;
+    if (time(NULL) - E.lastCheck < KILO_CHECK_INTERVAL) return;
+    if (editorCheckFile()) editorRefreshScreen();
+}
+
+void editorReloadCommand() {
+    if (!E.fileStatValid) {
+        editorSetStatusMessage("No file to reload");
+        return;
     }
-    else {
-        /* append current line to previous line then delete it */
-        E.cx = E.row[E.cy - 1].size;
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-        editorDelRow(E.cy);
-        E.cy--;
+    if (E.dirty) {
+        char *answer = editorPrompt("Discard changes and reload? (y/n): %s", NULL);
+        int yes = answer && (answer[0] == 'y' || answer[0] == 'Y');
+        free(answer);
+        if (!yes) return;
     }
+    editorReload();
 }
 
 /*** file IO ***/
 
-char *editorRowsToString(int *bufLen) {
-    int totalLen = 0;
+char *editorRowsToString(long *bufLen) {
+    long totalLen = 0;
     int j;
     for (j = 0; j < E.numRows; ++j)
         totalLen += E.row[j].size + 1;
     *bufLen = totalLen;
-    char *buf = malloc(totalLen);
+    char *buf = editorMalloc(totalLen);
     char *p = buf;
     for (j = 0; j < E.numRows; ++j) {
         memcpy(p, E.row[j].chars, E.row[j].size);
@@ -415,15 +2418,22 @@ char *editorRowsToString(int *bufLen) {
 
 void editorOpen(char * filename) {
     free(E.filename);
-    E.filename = strdup(filename);
+    E.filename = editorStrdup(filename);
+    editorUndoClear();
 
     FILE *fp = fopen(filename, "r");
     if (!fp) die("fopen");
+    STAT_BEGIN(STAT_OPEN);
 
     char *line = NULL;
     size_t lineCap = 0;
     ssize_t lineLen;
+    size_t countedCap = 0;
     while ((lineLen = getline(&line, &lineCap, fp)) != - 1) {
+        if (lineCap != countedCap) {
+            STAT_INC(allocs, 1); // getline grew its buffer
+            countedCap = lineCap;
+        }
         while (lineLen > 0 && (line[lineLen - 1] == '\n' ||
                             line[lineLen - 1] == '\r'))
             --lineLen;
@@ -432,6 +2442,8 @@ void editorOpen(char * filename) {
     free(line);
     fclose(fp);
     E.dirty = 0;
+    editorRecordFileStat();
+    STAT_END(STAT_OPEN);
 }
 
 void editorSave() {
@@ -443,7 +2455,20 @@ void editorSave() {
         }
     }
 
-    int len;
+    /* don't silently overwrite someone else's changes */
+    if (E.fileChanged || editorFileChangedOnDisk()) {
+        char *answer = editorPrompt("File changed on disk since it was read. "
+                "Overwrite? (y/n): %s", NULL);
+        int yes = answer && (answer[0] == 'y' || answer[0] == 'Y');
+        free(answer);
+        if (!yes) {
+            editorSetStatusMessage("Save aborted");
+            return;
+        }
+    }
+
+    STAT_BEGIN(STAT_SAVE);
+    long len;
     char *buf = editorRowsToString(&len);
 
     /* OCREAT : creat if file doesn't exist and open for reading and writing (O_RDWR) */
@@ -451,11 +2476,18 @@ void editorSave() {
     int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
     if (fd != -1) {
         if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
+            /* a single write() is capped below 2GB, keep going until done */
+            long written = 0;
+            ssize_t n;
+            while (written < len && (n = write(fd, buf + written, len - written)) > 0)
+                written += n;
+            if (written == len) {
                 close(fd);
                 free(buf);
                 E.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
+                editorRecordFileStat();
+                editorSetStatusMessage("%ld bytes written to disk", len);
+                STAT_END(STAT_SAVE);
                 return;
             }
         }
@@ -464,6 +2496,44 @@ void editorSave() {
 
     free(buf);
     editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+    STAT_END(STAT_SAVE);
+}
+
+/*** goto ***/
+
+void editorGoto() {
+    char *target = editorPrompt("Go to line: %s (b<n> for byte offset)", NULL);
+    if (target == NULL) return;
+
+    char *end;
+    int byOffset = (target[0] == 'b');
+    long n = strtol(byOffset ? target + 1 : target, &end, 10);
+    if (*end != '\0' || end == (byOffset ? target + 1 : target) || n < 0) {
+        editorSetStatusMessage("Invalid position: %s", target);
+        free(target);
+        return;
+    }
+    free(target);
+
+    if (byOffset) {
+        int at = lineIndexRow(n);
+        if (at >= E.numRows) {
+            /* past the end: land after the last char of the file */
+            E.cy = E.numRows > 0 ? E.numRows - 1 : 0;
+            E.cx = E.numRows > 0 ? E.row[E.cy].size : 0;
+        }
+        else {
+            E.cy = at;
+            E.cx = n - lineIndexOffset(at);
+            if (E.cx > E.row[at].size) E.cx = E.row[at].size;
+        }
+    }
+    else {
+        if (n < 1) n = 1;
+        if (n > E.numRows) n = E.numRows > 0 ? E.numRows : 1;
+        E.cy = n - 1;
+        E.cx = 0;
+    }
 }
 
 /*** find ***/
@@ -487,6 +2557,7 @@ void editorFindCallback(char *query, int key) {
         direction = 1;
     }
 
+    STAT_BEGIN(STAT_FIND);
     if (last_match == -1) direction = 1;
     int current = last_match;
     for (int i = 0; i < E.numRows; i++) {
@@ -504,7 +2575,7 @@ void editorFindCallback(char *query, int key) {
             break;
         }
     }
-
+    STAT_END(STAT_FIND);
 }
 
 void editorFind() {
@@ -527,6 +2598,216 @@ void editorFind() {
     }
 }
 
+/*** replace ***/
+
+typedef struct {
+    int *idx; // rows with at least one match
+    erow *rows; // their rebuilt contents
+    int n, cap;
+    long matches;
+} replacePart;
+
+typedef struct {
+    const char *query;
+    int queryLen;
+    const char *with;
+    int withLen;
+    int isRegex;
+    int nsub; // regmatch_t slots per match
+    replacePart parts[KILO_MAX_THREADS];
+} replaceJob;
+
+/* length of the replacement for one match, copied to dst unless NULL */
+/* in regex mode \0..\9 insert the groups and \\ a backslash */
+int replaceExpand(replaceJob *job, const char *chars, regmatch_t *m, char *dst) {
+    if (!job->isRegex) {
+        if (dst) memcpy(dst, job->with, job->withLen);
+        return job->withLen;
+    }
+    int len = 0;
+    for (int i = 0; i < job->withLen; ++i) {
+        const char *s = &job->with[i];
+        int n = 1;
+        if (job->with[i] == '\\' && i + 1 < job->withLen) {
+            char d = job->with[++i];
+            if (d >= '0' && d <= '9') {
+                int g = d - '0';
+                n = (g < job->nsub && m[g].rm_so != -1) ? m[g].rm_eo - m[g].rm_so : 0;
+                s = chars + m[g < job->nsub ? g : 0].rm_so;
+            }
+            else {
+                s = &job->with[i];
+            }
+        }
+        if (dst) memcpy(dst + len, s, n);
+        len += n;
+    }
+    return len;
+}
+
+/* find every match in rows [lo, hi) and rebuild the matching ones */
+void replaceRows(void *arg, int part, int lo, int hi) {
+    replaceJob *job = arg;
+    replacePart *out = &job->parts[part];
+    regmatch_t *m = NULL;
+    int mcap = 0;
+    regex_t re;
+    if (job->isRegex) editorRegexWorker(&re, job->query, REG_EXTENDED);
+
+    for (int i = lo; i < hi; ++i) {
+        erow *row = &E.row[i];
+        int count = 0;
+        int off = 0;
+        int lastEnd = -1;
+
+        /* pass 1: collect matches (groups included) */
+        while (off <= row->size) {
+            if (count == mcap) {
+                mcap = mcap ? mcap * 2 : 16;
+                m = editorRealloc(m, sizeof(regmatch_t) * job->nsub * mcap);
+            }
+            regmatch_t *cur = &m[count * job->nsub];
+            if (job->isRegex) {
+                if (regexec(&re, row->chars + off, job->nsub, cur,
+                            off ? REG_NOTBOL : 0) != 0) break;
+                for (int g = 0; g < job->nsub; ++g) {
+                    if (cur[g].rm_so == -1) continue;
+                    cur[g].rm_so += off;
+                    cur[g].rm_eo += off;
+                }
+            }
+            else {
+                char *hit = memmem(row->chars + off, row->size - off, job->query, job->queryLen);
+                if (!hit) break;
+                cur[0].rm_so = hit - row->chars;
+                cur[0].rm_eo = cur[0].rm_so + job->queryLen;
+            }
+            /* step past empty matches so they can't repeat forever, and */
+            /* skip one right after the previous match like sed does */
+            off = cur[0].rm_eo > cur[0].rm_so ? cur[0].rm_eo : cur[0].rm_eo + 1;
+            if (cur[0].rm_eo == cur[0].rm_so && cur[0].rm_so == lastEnd) continue;
+            lastEnd = cur[0].rm_eo;
+            count++;
+        }
+        if (count == 0) continue;
+
+        /* exact size of the new row */
+        long size = row->size;
+        for (int k = 0; k < count; ++k) {
+            regmatch_t *cur = &m[k * job->nsub];
+            size += replaceExpand(job, row->chars, cur, NULL) - (cur[0].rm_eo - cur[0].rm_so);
+        }
+
+        /* pass 2: build it in a single allocation */
+        erow nrow;
+        nrow.size = size;
+        nrow.chars = rowCharsAlloc(size + 1);
+        nrow.render = NULL;
+        int src = 0;
+        char *dst = nrow.chars;
+        for (int k = 0; k < count; ++k) {
+            regmatch_t *cur = &m[k * job->nsub];
+            memcpy(dst, row->chars + src, cur[0].rm_so - src);
+            dst += cur[0].rm_so - src;
+            dst += replaceExpand(job, row->chars, cur, dst);
+            src = cur[0].rm_eo;
+        }
+        memcpy(dst, row->chars + src, row->size - src);
+        nrow.chars[size] = '\0';
+        editorRenderRow(&nrow);
+
+        if (out->n == out->cap) {
+            out->cap = out->cap ? out->cap * 2 : 64;
+            out->idx = editorRealloc(out->idx, sizeof(int) * out->cap);
+            out->rows = editorRealloc(out->rows, sizeof(erow) * out->cap);
+        }
+        out->idx[out->n] = i;
+        out->rows[out->n++] = nrow;
+        out->matches += count;
+    }
+    free(m);
+    if (job->isRegex) regfree(&re);
+}
+
+/* replace every match of query in the buffer, as one undoable operation */
+void editorReplaceAll(const char *query, const char *with, int isRegex) {
+    replaceJob job;
+    memset(&job, 0, sizeof(job));
+    job.query = query;
+    job.queryLen = strlen(query);
+    job.with = with;
+    job.withLen = strlen(with);
+    job.isRegex = isRegex;
+    job.nsub = 1;
+
+    if (isRegex) {
+        int groups = editorRegexCheck(query, REG_EXTENDED);
+        if (groups < 0) return;
+        job.nsub = groups + 1;
+        if (job.nsub > 10) job.nsub = 10;
+    }
+
+    editorParallelFor(E.numRows, replaceRows, &job);
+
+    /* commit: swap rebuilt rows in, keep the old ones for undo */
+    undoEntry u;
+    u.kind = UNDO_ROWS;
+    u.n = 0;
+    long matches = 0;
+    int parts = editorParallelParts(E.numRows);
+    for (int p = 0; p < parts; ++p) {
+        u.n += job.parts[p].n;
+        matches += job.parts[p].matches;
+    }
+    u.idx = editorMalloc(sizeof(int) * (u.n ? u.n : 1));
+    u.rows = editorMalloc(sizeof(erow) * (u.n ? u.n : 1));
+
+    int j = 0;
+    for (int p = 0; p < parts; ++p) {
+        replacePart *part = &job.parts[p];
+        for (int k = 0; k < part->n; ++k, ++j) {
+            u.idx[j] = part->idx[k];
+            u.rows[j] = E.row[part->idx[k]];
+            E.row[part->idx[k]] = part->rows[k];
+        }
+        free(part->idx);
+        free(part->rows);
+    }
+
+    if (u.n == 0) {
+        editorUndoFree(&u);
+        editorSetStatusMessage("No matches for %s", query);
+        return;
+    }
+
+    lineIndexInvalidate();
+    editorUndoPush(&u);
+    E.dirty++;
+    if (E.cy < E.numRows && E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+    editorSetStatusMessage("Replaced %ld matches on %d lines (Ctrl-Z to undo)", matches, u.n);
+}
+
+void editorReplace() {
+    char *query = editorPrompt("Replace: %s (/regex/ for a regex)", NULL);
+    if (query == NULL) return;
+    char *with = editorPromptOpt("Replace with: %s", NULL, 1);
+    if (with == NULL) {
+        free(query);
+        return;
+    }
+
+    int len = strlen(query);
+    if (len > 2 && query[0] == '/' && query[len - 1] == '/') {
+        query[len - 1] = '\0';
+        editorReplaceAll(query + 1, with, 1);
+    }
+    else {
+        editorReplaceAll(query, with, 0);
+    }
+    free(query);
+    free(with);
+}
+
 /*** append buffer ***/
 
 /* dynamic string struct */
@@ -538,7 +2819,7 @@ typedef struct {
 #define ABUF_INIT {NULL, 0};
 
 void abAppend(abuf *ab, const char *s, int len) {
-    ab->b = realloc(ab->b, ab->len + len);
+    ab->b = editorRealloc(ab->b, ab->len + len);
     memcpy(&ab->b[ab->len], s, len);
     ab->len += len;
 }
@@ -568,7 +2849,70 @@ void editorScroll() {
     }
 }
 
+/* flag render columns [from, to) of the screen row in hl */
+int highlightSpan(char *hl, int from, int to) {
+    from -= E.colOff;
+    to -= E.colOff;
+    if (from < 0) from = 0;
+    if (to > E.screenCols) to = E.screenCols;
+    if (from >= to) return 0;
+    memset(&hl[from], 1, to - from);
+    return 1;
+}
+
+/* mark the selected and extra cursor cells of row y in hl; *ci walks */
+/* E.cursors along with the rows being drawn */
+int editorRowHighlight(int y, char *hl, int *ci) {
+    erow *row = &E.row[y];
+    int any = 0;
+    int hs, he;
+    memset(hl, 0, E.screenCols);
+    if (editorRowSelection(y, &hs, &he)) any |= highlightSpan(hl, hs, he);
+
+    while (*ci < E.numCursors && E.cursors[*ci].cy < y) ++*ci;
+    for (; *ci < E.numCursors && E.cursors[*ci].cy == y; ++*ci) {
+        cursor *cur = &E.cursors[*ci];
+        if (cur->ax == cur->cx) {
+            /* the terminal cursor already shows the primary one */
+            if (*ci == E.primary) continue;
+            int rx = editorRowCxToRx(row, cur->cx);
+            any |= highlightSpan(hl, rx, rx + 1);
+        }
+        else {
+            int a = cur->ax < cur->cx ? cur->ax : cur->cx;
+            int b = cur->ax < cur->cx ? cur->cx : cur->ax;
+            any |= highlightSpan(hl, editorRowCxToRx(row, a), editorRowCxToRx(row, b));
+        }
+    }
+    return any;
+}
+
+/* draw the visible part of a row with the cells flagged in hl inverted */
+void editorDrawHighlighted(abuf *ab, erow *row, const char *hl) {
+    int textLen = row->rsize - E.colOff;
+    if (textLen < 0) textLen = 0;
+    if (textLen > E.screenCols) textLen = E.screenCols;
+    /* highlighted cells can run past the text, e.g. a selected newline */
+    int width = textLen;
+    for (int i = textLen; i < E.screenCols; ++i)
+        if (hl[i]) width = i + 1;
+
+    int i = 0;
+    while (i < width) {
+        int j = i;
+        while (j < width && hl[j] == hl[i]) ++j;
+        if (hl[i]) abAppend(ab, "\x1b[7m", 4);
+        int textEnd = j < textLen ? j : textLen;
+        if (textEnd > i) abAppend(ab, &row->render[E.colOff + i], textEnd - i);
+        for (int k = i > textLen ? i : textLen; k < j; ++k) abAppend(ab, " ", 1);
+        if (hl[i]) abAppend(ab, "\x1b[m", 3);
+        i = j;
+    }
+}
+
 void editorDrawRows(abuf *ab) {
+    char *hl = editorMalloc(E.screenCols + 1);
+    int ci = editorFirstCursor(E.rowOff);
     int y;
     for (y = 0; y < E.screenRows; ++y) {
         int fileRow = y + E.rowOff;
@@ -591,15 +2935,23 @@ void editorDrawRows(abuf *ab) {
             }
         }
         else {
-            int len = E.row[fileRow].rsize - E.colOff;
-            if (len < 0) len = 0;
-            if (len > E.screenCols) len = E.screenCols;
-            abAppend(ab, &E.row[fileRow].render[E.colOff], len);
+            STAT_INC(rowsDrawn, 1);
+            erow *row = &E.row[fileRow];
+            if (editorRowHighlight(fileRow, hl, &ci)) {
+                editorDrawHighlighted(ab, row, hl);
+            }
+            else {
+                int len = row->rsize - E.colOff;
+                if (len < 0) len = 0;
+                if (len > E.screenCols) len = E.screenCols;
+                abAppend(ab, &row->render[E.colOff], len);
+            }
         }
 
         abAppend(ab, "\x1b[K", 3); // clear to the end of line
         abAppend(ab, "\r\n", 2);
     }
+    free(hl);
 }
 
 void editorDrawStatusBar(abuf *ab) {
@@ -608,8 +2960,9 @@ void editorDrawStatusBar(abuf *ab) {
     int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
             E.filename ? E.filename : "[No Name]", E.numRows,
             E.dirty ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d",
-            E.cy + 1, E.numRows);
+    long offset = lineIndexOffset(E.cy) + (E.cy < E.numRows ? E.cx : 0);
+    int rlen = snprintf(rstatus, sizeof(rstatus), "byte %ld | %d/%d",
+            offset, E.cy + 1, E.numRows);
     if (len > E.screenCols) len = E.screenCols;
     abAppend(ab, status, len);
     while (len < E.screenCols) {
@@ -628,6 +2981,16 @@ void editorDrawStatusBar(abuf *ab) {
 
 void editorDrawMessageBar(abuf *ab) {
     abAppend(ab, "\x1b[K", 3);
+#ifdef KILO_STATS
+    if (S.overlay) {
+        char stats[256];
+        int statsLen = statFormat(stats, sizeof(stats));
+        if (statsLen > (int)sizeof(stats) - 1) statsLen = sizeof(stats) - 1;
+        if (statsLen > E.screenCols) statsLen = E.screenCols;
+        abAppend(ab, stats, statsLen);
+        return;
+    }
+#endif
     int msgLen = strlen(E.statusmsg);
     if (msgLen > E.screenCols) msgLen = E.screenCols;
     if (msgLen && time(NULL) - E.statusmsg_time < 5)
@@ -635,6 +2998,8 @@ void editorDrawMessageBar(abuf *ab) {
 }
 
 void editorRefreshScreen() {
+    if (E.batch) return;
+    STAT_BEGIN(STAT_REFRESH);
     editorScroll();
 
     abuf ab = ABUF_INIT;
@@ -653,8 +3018,10 @@ void editorRefreshScreen() {
 
     abAppend(&ab, "\x1b[?25h", 6); // show the cursor back
 
-    write(STDOUT_FILENO, ab.b, ab.len);
+    T.write(STDOUT_FILENO, ab.b, ab.len);
+    STAT_INC(bytesOut, ab.len);
     abFree(&ab);
+    STAT_END(STAT_REFRESH);
 }
 
 void editorSetStatusMessage(const char *fmt, ...) { // flexible number of arguments
@@ -668,8 +3035,13 @@ void editorSetStatusMessage(const char *fmt, ...) { // flexible number of argume
 /*** input ***/
 
 char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
+    return editorPromptOpt(prompt, callback, 0);
+}
+
+/* allowEmpty: Enter on an empty input returns "" instead of being ignored */
+char *editorPromptOpt(char *prompt, void (*callback)(char *, int), int allowEmpty) {
     size_t bufSize = 128;
-    char *buf = malloc(bufSize);
+    char *buf = editorMalloc(bufSize);
 
     size_t bufLen = 0;
     buf[0] = '\0';
@@ -678,7 +3050,12 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
         editorSetStatusMessage(prompt, buf);
         editorRefreshScreen();
 
+        E.prompting++;
+        STAT_WAIT_BEGIN();
         int c = editorReadKey();
+        STAT_WAIT_END();
+        E.prompting--;
+        if (c == FOCUS_IN || c == FOCUS_OUT) continue;
         if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
             if (bufLen != 0) buf[--bufLen] = '\0';
         }
@@ -689,7 +3066,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
             return NULL;
         }
         else if (c == '\r') {
-            if (bufLen != 0) {
+            if (bufLen != 0 || allowEmpty) {
                 editorSetStatusMessage("");
                 if (callback) callback(buf, c);
                 return buf;
@@ -698,7 +3075,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
         else if (!iscntrl(c) && c < 128) {
             if (bufLen == bufSize - 1) {
                 bufSize *= 2;
-                buf = realloc(buf, bufSize);
+                buf = editorRealloc(buf, bufSize);
             }
             buf[bufLen++] = c;
             buf[bufLen] = '\0';
@@ -750,6 +3127,19 @@ void editorMoveCursor(int key) {
 void editorProcessKeypress() {
     static int quit_times = KILO_QUIT_TIMES;
     int c = editorReadKey();
+    STAT_BEGIN(STAT_KEYPRESS);
+
+    if (c == FOCUS_IN || c == FOCUS_OUT) {
+        if (c == FOCUS_IN) editorCheckFile();
+        STAT_END(STAT_KEYPRESS);
+        return;
+    }
+
+    if (E.numCursors > 0 && editorMultiCursorKey(c)) {
+        E.yanked = 0;
+        STAT_END(STAT_KEYPRESS);
+        return;
+    }
 
     switch(c) {
         case '\r':
@@ -761,10 +3151,11 @@ void editorProcessKeypress() {
                 editorSetStatusMessage("WARNING!!! File has unsaved changes. "
                         "Press Ctrl-Q %d more times to quit.", quit_times);
                 quit_times--;
+                STAT_END(STAT_KEYPRESS);
                 return;
             }
-            write(STDOUT_FILENO, "\x1b[2J", 4);
-            write(STDOUT_FILENO, "\x1b[H", 3);
+            T.write(STDOUT_FILENO, "\x1b[2J", 4);
+            T.write(STDOUT_FILENO, "\x1b[H", 3);
             exit(0);
             break;
 
@@ -785,6 +3176,65 @@ void editorProcessKeypress() {
             editorFind();
             break;
 
+        case CTRL_KEY('g'):
+            editorGoto();
+            break;
+
+        case CTRL_KEY('r'):
+            editorReplace();
+            break;
+
+        case CTRL_KEY('z'):
+            editorUndo();
+            break;
+
+        case CTRL_KEY('@'): // Ctrl-Space
+            editorToggleMark();
+            break;
+
+        case CTRL_KEY('c'):
+        case CTRL_KEY('x'):
+            editorCopy(c == CTRL_KEY('x'));
+            break;
+
+        case CTRL_KEY('v'):
+            editorPaste();
+            break;
+
+        case CTRL_KEY('y'):
+            editorYankPop();
+            break;
+
+        case CTRL_KEY('d'):
+            editorAddCursorBelow();
+            break;
+
+        case CTRL_KEY('b'):
+            editorBlockCursors();
+            break;
+
+        case CTRL_KEY('o'):
+            editorMacroToggle();
+            break;
+
+        case CTRL_KEY('p'):
+            editorLineCommand();
+            break;
+
+        case CTRL_KEY('u'):
+            editorReloadCommand();
+            break;
+
+        case CTRL_KEY('e'):
+            editorMacroRun();
+            break;
+
+#ifdef KILO_STATS
+        case CTRL_KEY('t'):
+            S.overlay = !S.overlay;
+            break;
+#endif
+
         case BACKSPACE:
         case CTRL_KEY('h'):
         case DEL_KEY:
@@ -810,12 +3260,17 @@ void editorProcessKeypress() {
             break;
 
         case CTRL_KEY('l'):
+            break; // ignore terminal refresh
         case '\x1b':
-            break; // ignore terminal refresh and escape key + some escape sequences 
+            E.markSet = 0;
+            break; // escape key + some escape sequences clear the selection
         default:
             editorInsertChar(c);
             break;
     }
+    /* yank-pop only makes sense straight after a paste */
+    if (c != CTRL_KEY('v') && c != CTRL_KEY('y')) E.yanked = 0;
+    STAT_END(STAT_KEYPRESS);
 }
 
 /*** init ***/
@@ -829,23 +3284,52 @@ void initEditor() {
     E.colOff = 0;
     E.numRows = 0;
     E.row = NULL;
+    E.lineIdx.count = NULL;
+    E.lineIdx.bytes = NULL;
+    E.lineIdx.countTree = NULL;
+    E.lineIdx.bytesTree = NULL;
+    E.lineIdx.stale = NULL;
+    E.lineIdx.staleList = NULL;
+    E.lineIdx.numStale = 0;
+    E.lineIdx.blocks = 0;
+    E.lineIdx.cap = 0;
+    E.lineIdx.valid = 0;
+    E.numUndo = 0;
+    E.markSet = 0;
+    E.numKill = 0;
+    E.yanked = 0;
+    E.cursors = NULL;
+    E.numCursors = 0;
+    E.primary = 0;
+    E.macro.keys = NULL;
+    E.macro.len = E.macro.cap = 0;
+    E.macro.recording = E.macro.playing = 0;
+    E.batch = 0;
+    E.prompting = 0;
+    E.fileStatValid = 0;
+    E.fileChanged = 0;
+    E.lastCheck = time(NULL);
     E.dirty = 0;
     E.filename = NULL;
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
 
-    if (getWindowSize(&E.screenRows, &E.screenCols) == -1) die("getWindowSize");
+    if (T.windowSize(&E.screenRows, &E.screenCols) == -1) die("getWindowSize");
     E.screenRows -= 2;
 }
 
+#ifndef KILO_NO_MAIN
 int main(int argc, char *argv[]) {
     enableRawMode();
     initEditor();
+#ifdef KILO_STATS
+    atexit(statDump);
+#endif
     if  (argc >= 2) {
         editorOpen(argv[1]);
     }
 
-    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-G = goto | Ctrl-R = replace");
 
     while(1) {
         editorRefreshScreen();
@@ -854,3 +3338,4 @@ int main(int argc, char *argv[]) {
 
     return 0;
 }
+#endif